@@ -10,30 +10,102 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 1024
+#define MAX_MSG_SIZE 1024*1024
+
+// Framed protocol (see server_grp.cpp): after the text greeting the client sends
+// FRAME_HELLO, and from then on every message is a 4-byte big-endian length plus payload.
+#define FRAME_HELLO "\0FRAMED\n"
+#define FRAME_HELLO_LEN 8
+#define FRAME_HEADER_SIZE 4
 
 std::mutex cout_mutex;
+bool framed = false;    // True once the framed protocol has been negotiated
+std::string inbuf;      // Received bytes not yet returned by recv_message
+
+bool send_raw(int socket, const char* data, size_t length) {
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        ssize_t bytes_sent = send(socket, data + total_sent, length - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) return false;
+        total_sent += bytes_sent;
+    }
+    return true;
+}
 
-void handle_server_messages(int server_socket) {
+// Send one message; in framed mode it is prefixed with its length.
+bool send_message(int socket, const std::string& message) {
+    if (!framed) {
+        return send_raw(socket, message.c_str(), message.size());
+    }
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    uint32_t length = message.size();
+    frame[0] = (char)(length >> 24);
+    frame[1] = (char)(length >> 16);
+    frame[2] = (char)(length >> 8);
+    frame[3] = (char)length;
+    frame += message;
+    return send_raw(socket, frame.data(), frame.size());
+}
+
+// Receive one message. In text mode this is whatever a single recv returns.
+bool recv_message(int socket, std::string& message) {
     char buffer[BUFFER_SIZE];
+    if (!framed) {
+        int bytes_received = recv(socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0) return false;
+        message.assign(buffer, bytes_received);
+        return true;
+    }
+    while (true) {
+        if (inbuf.size() >= FRAME_HEADER_SIZE) {
+            const unsigned char* h = (const unsigned char*)inbuf.data();
+            uint32_t length = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+            if (length > MAX_MSG_SIZE) return false;
+            if (inbuf.size() >= FRAME_HEADER_SIZE + length) {
+                message = inbuf.substr(FRAME_HEADER_SIZE, length);
+                inbuf.erase(0, FRAME_HEADER_SIZE + length);
+                return true;
+            }
+        }
+        int bytes_received = recv(socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0) return false;
+        inbuf.append(buffer, bytes_received);
+    }
+}
+
+void handle_server_messages(int server_socket) {
+    std::string message;
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
+        if (!recv_message(server_socket, message)) {
             std::lock_guard<std::mutex> lock(cout_mutex);
             std::cout << "Disconnected from server." << std::endl;
             close(server_socket);
             exit(0);
         }
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << message << std::endl;
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    bool use_frames = true;
+    int port = 12345;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string(argv[i]) == "--text") {
+            use_frames = false;  // Talk the legacy one-recv-per-message protocol
+        } else if (std::string(argv[i]) == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);  // Another node of a cluster
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--text] [--port N]" << std::endl;
+            return 1;
+        }
+    }
+
     int client_socket;
     sockaddr_in server_address{};
 
@@ -44,7 +116,7 @@ int main() {
     }
 
     server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12345);
+    server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
 
     if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
@@ -55,29 +127,31 @@ int main() {
     std::cout << "Connected to the server." << std::endl;
 
     // Authentication
-    std::string username, password;
-    char buffer[BUFFER_SIZE];
+    std::string username, password, reply;
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
+    recv_message(client_socket, reply); // Receive the message "Enter the user name" for the server
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
- 
-    std::cout << buffer;
+    if (use_frames) {
+        // Switch to frames; the server repeats the prompt as the first frame
+        send_raw(client_socket, FRAME_HELLO, FRAME_HELLO_LEN);
+        framed = true;
+        recv_message(client_socket, reply);
+    }
+
+    std::cout << reply;
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
+    send_message(client_socket, username);
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
+    recv_message(client_socket, reply); // Receive the message "Enter the password" for the server
+    std::cout << reply;
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    send_message(client_socket, password);
 
-    memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
+    recv_message(client_socket, reply);
+    std::cout << reply << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+    if (reply.find("Authentication failed") != std::string::npos) {
         close(client_socket);
         return 1;
     }
@@ -94,7 +168,7 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        send_message(client_socket, message);
 
         if (message == "/exit") {
             close(client_socket);
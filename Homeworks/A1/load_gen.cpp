@@ -0,0 +1,527 @@
+// load_gen.cpp
+// Load generator for server_grp. It opens many authenticated sessions over the framed
+// protocol, replays a mix of /msg, /broadcast and /group_msg at a fixed rate and reports
+// throughput and delivery latency as JSON. Every payload carries its send time, so latency
+// is measured where the message is delivered.
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+#define DEFAULT_PORT 12345
+#define BUFFER_SIZE 64*1024
+#define MAX_EVENTS 1024
+#define MAX_MSG_SIZE 1024*1024
+#define CONNECT_WINDOW 256          // Logins in progress per worker thread
+#define FRAME_HELLO "\0FRAMED\n"
+#define FRAME_HELLO_LEN 8
+#define FRAME_HEADER_SIZE 4
+#define GREETING_LEN 16             // "Enter username: ", sent before framing starts
+#define STAMP_MARK '@'              // Payloads carry "@<send time in ns>@"
+#define HIST_SUB_BUCKETS 64         // Histogram resolution: 64 buckets per power of two
+
+enum SessionState { AWAIT_GREETING, AWAIT_LOGIN, READY, FAILED };
+enum CommandKind { CMD_MSG, CMD_BROADCAST, CMD_GROUP, CMD_KINDS };
+enum Phase { PHASE_LOGIN, PHASE_RUN, PHASE_DRAIN, PHASE_DONE };
+
+const char* command_names[CMD_KINDS] = {"msg", "broadcast", "group_msg"};
+
+struct Options {
+    string host = "127.0.0.1";
+    int port = DEFAULT_PORT;
+    string users_file = "users.txt";
+    int sessions = 1000;
+    int threads = max(1u, thread::hardware_concurrency());
+    double rate = 1000;             // Commands per second over all sessions
+    double duration = 10;
+    double drain = 2;               // Seconds to keep receiving after the last command
+    int groups = 100;
+    size_t size = 64;               // Payload bytes per command
+    double mix[CMD_KINDS] = {80, 1, 19};
+    string json_file;               // Empty: print to stdout
+};
+
+// Log-linear histogram of nanosecond values with about 1.5% relative error
+struct Histogram {
+    vector<uint64_t> counts = vector<uint64_t>(64 * HIST_SUB_BUCKETS);
+    uint64_t total = 0;
+    uint64_t max_value = 0;
+    double sum = 0;
+
+    static size_t index(uint64_t value) {
+        if (value < HIST_SUB_BUCKETS) return value;
+        int msb = 63 - __builtin_clzll(value);
+        return (msb - 5) * HIST_SUB_BUCKETS + ((value >> (msb - 6)) & (HIST_SUB_BUCKETS - 1));
+    }
+
+    static uint64_t lower_bound(size_t index) {
+        if (index < HIST_SUB_BUCKETS) return index;
+        int msb = index / HIST_SUB_BUCKETS + 5;
+        return (HIST_SUB_BUCKETS + index % HIST_SUB_BUCKETS) << (msb - 6);
+    }
+
+    void record(uint64_t value) {
+        counts[index(value)]++;
+        total++;
+        sum += value;
+        max_value = max(max_value, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        max_value = max(max_value, other.max_value);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t target = max<uint64_t>(1, (uint64_t)ceil(p * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= target) return min(lower_bound(i), max_value);
+        }
+        return max_value;
+    }
+};
+
+struct Session {
+    int fd = -1;
+    int user;                       // Index into the credentials list
+    SessionState state = AWAIT_GREETING;
+    int handshake_frames = 0;       // Frames seen so far; the second one is the verdict
+    string inbuf;
+    string outbuf;
+};
+
+// One thread's share of the sessions, with its own epoll instance and statistics
+struct Worker {
+    int epoll_fd = -1;
+    vector<Session> sessions;
+    vector<int> ready;              // Sessions that finished logging in
+    size_t next_connect = 0;
+    int logging_in = 0;
+    Histogram latency;
+    uint64_t sent[CMD_KINDS] = {};
+    uint64_t delivered = 0;
+    uint64_t errors = 0;
+    uint64_t failed = 0;
+    mt19937_64 rng;
+};
+
+Options opts;
+vector<pair<string, string>> credentials;
+atomic<int> phase{PHASE_LOGIN};
+atomic<int> logins_done{0};         // Sessions that are ready or failed
+atomic<int64_t> run_start_ns{0};    // Only messages stamped after this are measured
+sockaddr_in server_addr{};
+
+int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void append_frame(string& out, const string& payload) {
+    uint32_t length = payload.size();
+    char header[FRAME_HEADER_SIZE] = {(char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length};
+    out.append(header, FRAME_HEADER_SIZE);
+    out += payload;
+}
+
+// Write as much of the session's pending output as the socket takes
+bool flush_session(Session& session) {
+    while (!session.outbuf.empty()) {
+        ssize_t sent = send(session.fd, session.outbuf.data(), session.outbuf.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session.outbuf.erase(0, sent);
+    }
+    return true;
+}
+
+void fail_session(Worker& worker, Session& session) {
+    if (session.state == FAILED) return;
+    if (session.state != READY) {
+        worker.logging_in--;
+        worker.failed++;
+        logins_done++;
+    }
+    session.state = FAILED;
+    close(session.fd);
+}
+
+// Start a non-blocking connect and queue the whole login behind it: the framing hello and
+// a single /login frame go out in one write, and the server answers in order.
+void start_session(Worker& worker, size_t index) {
+    Session& session = worker.sessions[index];
+    session.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    worker.logging_in++;
+    if (session.fd < 0) {
+        worker.logging_in--;
+        worker.failed++;
+        logins_done++;
+        session.state = FAILED;
+        return;
+    }
+    int one = 1;
+    setsockopt(session.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(session.fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        fail_session(worker, session);
+        return;
+    }
+    const auto& [username, password] = credentials[session.user];
+    session.outbuf.assign(FRAME_HELLO, FRAME_HELLO_LEN);
+    append_frame(session.outbuf, "/login " + username + " " + password);
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = index;
+    epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, session.fd, &ev);
+}
+
+// Handle one frame from the server: the login replies, then delivered messages
+void on_frame(Worker& worker, size_t index, const char* data, size_t length) {
+    Session& session = worker.sessions[index];
+    if (session.state == AWAIT_LOGIN) {
+        if (++session.handshake_frames < 2) return;  // The repeated "Enter username: "
+        worker.logging_in--;
+        logins_done++;
+        if (length < 7 || memcmp(data, "Welcome", 7) != 0) {
+            worker.failed++;
+            session.state = FAILED;
+            close(session.fd);
+            return;
+        }
+        session.state = READY;
+        worker.ready.push_back(index);
+        if (opts.groups > 0) {
+            // Whoever comes first creates the group; the other reply is a harmless error
+            string group = "g" + to_string(session.user % opts.groups);
+            append_frame(session.outbuf, "/create_group " + group);
+            append_frame(session.outbuf, "/join_group " + group);
+        }
+        return;
+    }
+
+    const char* mark = (const char*)memchr(data, STAMP_MARK, length);
+    if (mark) {
+        int64_t stamp = strtoll(mark + 1, nullptr, 10);
+        if (stamp >= run_start_ns.load(memory_order_relaxed)) {
+            worker.latency.record(max<int64_t>(0, now_ns() - stamp));
+            worker.delivered++;
+        }
+    } else if (phase.load(memory_order_relaxed) != PHASE_LOGIN && length >= 5 && memcmp(data, "Error", 5) == 0) {
+        worker.errors++;
+    }
+}
+
+bool read_session(Worker& worker, size_t index, char* buffer) {
+    Session& session = worker.sessions[index];
+    while (true) {
+        ssize_t received = recv(session.fd, buffer, BUFFER_SIZE, 0);
+        if (received == 0) return false;
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        session.inbuf.append(buffer, received);
+
+        size_t pos = 0;
+        if (session.state == AWAIT_GREETING) {
+            if (session.inbuf.size() < GREETING_LEN) continue;
+            pos = GREETING_LEN;  // The text greeting; everything after it is framed
+            session.state = AWAIT_LOGIN;
+        }
+        while (session.inbuf.size() - pos >= FRAME_HEADER_SIZE) {
+            const unsigned char* h = (const unsigned char*)session.inbuf.data() + pos;
+            uint32_t length = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+            if (length > MAX_MSG_SIZE) return false;
+            if (session.inbuf.size() - pos - FRAME_HEADER_SIZE < length) break;
+            on_frame(worker, index, session.inbuf.data() + pos + FRAME_HEADER_SIZE, length);
+            if (session.state == FAILED) return true;
+            pos += FRAME_HEADER_SIZE + length;
+        }
+        session.inbuf.erase(0, pos);
+    }
+}
+
+// Queue one command from a random ready session, chosen by the configured mix
+void send_command(Worker& worker, const string& padding, const double* cumulative) {
+    size_t index = worker.ready[worker.rng() % worker.ready.size()];
+    Session& session = worker.sessions[index];
+    if (session.state != READY) return;
+
+    double pick = uniform_real_distribution<double>(0, cumulative[CMD_KINDS - 1])(worker.rng);
+    int kind = 0;
+    while (kind < CMD_KINDS - 1 && pick >= cumulative[kind]) kind++;
+
+    string stamp = STAMP_MARK + to_string(now_ns()) + STAMP_MARK;
+    string command;
+    if (kind == CMD_MSG) {
+        command = "/msg " + credentials[worker.rng() % min<size_t>(credentials.size(), opts.sessions)].first + " ";
+    } else if (kind == CMD_BROADCAST) {
+        command = "/broadcast ";
+    } else {
+        command = "/group_msg g" + to_string(session.user % opts.groups) + " ";
+    }
+    command += stamp;
+    if (padding.size() > stamp.size()) command.append(padding, 0, padding.size() - stamp.size());
+    append_frame(session.outbuf, command);
+    worker.sent[kind]++;
+    if (!flush_session(session)) {
+        fail_session(worker, session);
+    }
+}
+
+void worker_loop(Worker& worker, double rate) {
+    epoll_event events[MAX_EVENTS];
+    vector<char> buffer(BUFFER_SIZE);
+    string padding(opts.size, 'x');
+    double cumulative[CMD_KINDS];
+    for (int i = 0; i < CMD_KINDS; ++i) {
+        cumulative[i] = opts.mix[i] + (i ? cumulative[i - 1] : 0);
+    }
+    if (opts.groups <= 0) cumulative[CMD_GROUP] = cumulative[CMD_BROADCAST];  // No groups to talk to
+    uint64_t commands = 0;
+
+    while (phase.load() != PHASE_DONE) {
+        while (worker.logging_in < CONNECT_WINDOW && worker.next_connect < worker.sessions.size()) {
+            start_session(worker, worker.next_connect++);
+        }
+
+        int current = phase.load();
+        if (current == PHASE_RUN && !worker.ready.empty()) {
+            // Open loop: catch up with the schedule, whatever the server's response time
+            double elapsed = (now_ns() - run_start_ns.load()) / 1e9;
+            uint64_t due = (uint64_t)(elapsed * rate);
+            for (int burst = 0; commands < due && burst < 10000; ++burst, ++commands) {
+                send_command(worker, padding, cumulative);
+            }
+        }
+
+        int n = epoll_wait(worker.epoll_fd, events, MAX_EVENTS, current == PHASE_RUN ? 1 : 10);
+        for (int i = 0; i < n; ++i) {
+            size_t index = events[i].data.u64;
+            Session& session = worker.sessions[index];
+            if (session.state == FAILED) continue;
+            if ((events[i].events & EPOLLIN) && !read_session(worker, index, buffer.data())) {
+                fail_session(worker, session);
+                continue;
+            }
+            if (session.state != FAILED && !flush_session(session)) {
+                fail_session(worker, session);
+            }
+        }
+    }
+    for (Session& session : worker.sessions) {
+        if (session.state != FAILED && session.fd >= 0) close(session.fd);
+    }
+}
+
+// Write a users file with n generated accounts for the server to load
+int make_users(int n, const string& path) {
+    ofstream file(path);
+    for (int i = 0; i < n; ++i) {
+        file << "load" << i << ":pass" << i << "\n";
+    }
+    if (!file) {
+        cerr << "Error: cannot write " << path << endl;
+        return 1;
+    }
+    cerr << "Wrote " << n << " users to " << path << endl;
+    return 0;
+}
+
+bool parse_mix(const string& spec) {
+    double mix[CMD_KINDS] = {};
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) return false;
+        string name = item.substr(0, eq);
+        int kind = find(command_names, command_names + CMD_KINDS, name) - command_names;
+        if (kind == CMD_KINDS) return false;
+        mix[kind] = atof(item.c_str() + eq + 1);
+    }
+    if (mix[CMD_MSG] + mix[CMD_BROADCAST] + mix[CMD_GROUP] <= 0) return false;
+    copy(mix, mix + CMD_KINDS, opts.mix);
+    return true;
+}
+
+void raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--make-users" && i + 2 < argc) {
+            return make_users(atoi(argv[i + 1]), argv[i + 2]);
+        } else if (arg == "--host" && has_value) {
+            opts.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            opts.port = atoi(argv[++i]);
+        } else if (arg == "--users" && has_value) {
+            opts.users_file = argv[++i];
+        } else if (arg == "--sessions" && has_value) {
+            opts.sessions = max(1, atoi(argv[++i]));
+        } else if (arg == "--threads" && has_value) {
+            opts.threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--rate" && has_value) {
+            opts.rate = max(0.0, atof(argv[++i]));
+        } else if (arg == "--duration" && has_value) {
+            opts.duration = max(0.1, atof(argv[++i]));
+        } else if (arg == "--drain" && has_value) {
+            opts.drain = max(0.0, atof(argv[++i]));
+        } else if (arg == "--groups" && has_value) {
+            opts.groups = max(0, atoi(argv[++i]));
+        } else if (arg == "--size" && has_value) {
+            opts.size = max(1, atoi(argv[++i]));
+        } else if (arg == "--mix" && has_value && parse_mix(argv[i + 1])) {
+            ++i;
+        } else if (arg == "--json" && has_value) {
+            opts.json_file = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--host ADDR] [--port N] [--users FILE] [--sessions N] [--threads N]"
+                 << " [--rate CMDS_PER_SEC] [--duration SEC] [--drain SEC] [--groups N] [--size BYTES]"
+                 << " [--mix msg=W,broadcast=W,group_msg=W] [--json FILE]" << endl
+                 << "       " << argv[0] << " --make-users N FILE" << endl;
+            return 1;
+        }
+    }
+
+    ifstream file(opts.users_file);
+    string line;
+    while (getline(file, line)) {
+        size_t colon = line.find(':');
+        if (colon != string::npos) {
+            credentials.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+        }
+    }
+    if (credentials.empty()) {
+        cerr << "Error: no users in " << opts.users_file << endl;
+        return 1;
+    }
+    if ((size_t)opts.sessions > credentials.size()) {
+        cerr << "Warning: " << opts.sessions << " sessions but only " << credentials.size()
+             << " users; the server needs --sessions to let users log in more than once" << endl;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opts.port);
+    if (inet_pton(AF_INET, opts.host.c_str(), &server_addr.sin_addr) != 1) {
+        cerr << "Error: invalid host " << opts.host << endl;
+        return 1;
+    }
+    raise_fd_limit();
+
+    // Deal the sessions out to the workers
+    int num_threads = min(opts.threads, opts.sessions);
+    vector<unique_ptr<Worker>> workers;
+    for (int t = 0; t < num_threads; ++t) {
+        auto worker = make_unique<Worker>();
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->rng.seed(t + 1);
+        for (int i = t; i < opts.sessions; i += num_threads) {
+            Session session;
+            session.user = i % credentials.size();
+            worker->sessions.push_back(std::move(session));
+        }
+        workers.push_back(std::move(worker));
+    }
+    vector<thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(worker_loop, ref(*worker), opts.rate / num_threads);
+    }
+
+    int64_t login_start = now_ns();
+    while (logins_done.load() < opts.sessions) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    double login_seconds = (now_ns() - login_start) / 1e9;
+    this_thread::sleep_for(chrono::milliseconds(500));  // Let group joins settle
+
+    run_start_ns = now_ns();
+    phase = PHASE_RUN;
+    this_thread::sleep_for(chrono::duration<double>(opts.duration));
+    double run_seconds = (now_ns() - run_start_ns.load()) / 1e9;
+    phase = PHASE_DRAIN;
+    this_thread::sleep_for(chrono::duration<double>(opts.drain));
+    phase = PHASE_DONE;
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    Histogram latency;
+    uint64_t sent[CMD_KINDS] = {}, sent_total = 0, delivered = 0, errors = 0, failed = 0;
+    for (const auto& worker : workers) {
+        latency.merge(worker->latency);
+        for (int k = 0; k < CMD_KINDS; ++k) {
+            sent[k] += worker->sent[k];
+            sent_total += worker->sent[k];
+        }
+        delivered += worker->delivered;
+        errors += worker->errors;
+        failed += worker->failed;
+    }
+
+    ostringstream json;
+    json << "{\n"
+         << "  \"sessions\": " << opts.sessions << ",\n"
+         << "  \"logged_in\": " << opts.sessions - failed << ",\n"
+         << "  \"login_seconds\": " << login_seconds << ",\n"
+         << "  \"threads\": " << num_threads << ",\n"
+         << "  \"target_rate\": " << opts.rate << ",\n"
+         << "  \"duration_seconds\": " << run_seconds << ",\n"
+         << "  \"payload_bytes\": " << opts.size << ",\n"
+         << "  \"groups\": " << opts.groups << ",\n"
+         << "  \"sent\": {";
+    for (int k = 0; k < CMD_KINDS; ++k) {
+        json << "\"" << command_names[k] << "\": " << sent[k] << ", ";
+    }
+    json << "\"total\": " << sent_total << "},\n"
+         << "  \"send_rate\": " << sent_total / run_seconds << ",\n"
+         << "  \"delivered\": " << delivered << ",\n"
+         << "  \"delivery_rate\": " << delivered / run_seconds << ",\n"
+         << "  \"errors\": " << errors << ",\n"
+         << "  \"latency_us\": {\"p50\": " << latency.percentile(0.5) / 1e3
+         << ", \"p99\": " << latency.percentile(0.99) / 1e3
+         << ", \"p999\": " << latency.percentile(0.999) / 1e3
+         << ", \"max\": " << latency.max_value / 1e3
+         << ", \"mean\": " << (latency.total ? latency.sum / latency.total / 1e3 : 0) << "}\n"
+         << "}\n";
+
+    if (opts.json_file.empty()) {
+        cout << json.str();
+    } else {
+        ofstream(opts.json_file) << json.str();
+        cerr << "Results written to " << opts.json_file << endl;
+    }
+    return 0;
+}
@@ -3,376 +3,4489 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <sstream>
+#include <iomanip>
 #include <fstream>
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <csignal>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <dirent.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
 
 using namespace std;
 
 #define MAX_MSG_SIZE 1024*1024
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 64*1024
 #define PORT 12345
 #define USERS_FILE "users.txt"
+#define DEFAULT_REACTORS 4          // 0 means one per core
+#define MAX_EVENTS 1024
+#define DEFAULT_MAX_SESSIONS 1
+#define DEFAULT_OUTQ 1024           // Messages queued per client before the overflow policy applies
+#define OUTQ_HARD_LIMIT_FACTOR 4    // Backpressure still disconnects at this multiple of the limit
+#define ZEROCOPY_MIN_SIZE 16*1024   // Smaller sends are cheaper to copy than to pin
+#define WRITE_BATCH 64              // Queued messages coalesced into one sendmsg
+#define URING_ENTRIES 4096          // Submission queue size per reactor
+#define URING_BUFFERS 256           // Provided receive buffers per reactor (power of two)
+#define URING_BUFFER_SIZE 16*1024
+#define URING_BUFFER_GROUP 0
+#define LOG_SEGMENT_SIZE (64ull*1024*1024)  // Bytes per message log segment file
+#define LOG_HEADER_SIZE 8           // Record body length and checksum
+#define LOG_REPLAY_WAIT_MS 10       // Retry interval while a backlog waits for queue space
+#define DEFAULT_AUTH_WORKERS 2      // Threads that verify hashed passwords
+#define AUTH_QUEUE_LIMIT 4096       // Logins waiting for a worker before new ones are turned away
+#define MAX_DEFERRED_INPUT 64       // Messages accepted while a login is being verified
+#define DEFAULT_LOGIN_TIMEOUT 10    // Seconds a connection may take to log in
+#define DEFAULT_MAX_UNAUTHENTICATED 16384   // Connections allowed to be logging in at once
 
-mutex clients_mutex;
-mutex groups_mutex;
-mutex active_users_mutex;
-// mutex client_groups_mutex;
+// Framed protocol: a client that answers the text greeting with FRAME_HELLO switches the
+// connection to frames, each a 4-byte big-endian payload length followed by the payload.
+#define FRAME_HELLO "\0FRAMED\n"
+#define FRAME_HELLO_LEN 8
+#define FRAME_HEADER_SIZE 4
 
-unordered_map<int, string> clients;
-unordered_map<string, string> users;
-unordered_map<string, bool> active_users;
-unordered_map<string, unordered_set<int>> groups; // Group Name → Set of Clients
-unordered_map<int, unordered_set<string>> client_groups;  // Client Socket → Set of Group Names
+enum ClientState { AWAIT_USERNAME, AWAIT_PASSWORD, AUTH_PENDING, AUTHENTICATED };
 
-void load_users() {
-    ifstream file(USERS_FILE);
-    string line;
-    while (getline(file, line)) {
-        size_t colon = line.find(':');
-        if (colon != string::npos) {
-            users[line.substr(0, colon)] = line.substr(colon + 1);
-            active_users[line.substr(0, colon)] = false;
+// What an io_uring completion belongs to, kept in the low bits of its user_data
+enum UringOp { URING_RECV = 1, URING_SEND, URING_ACCEPT, URING_WAKE, URING_CANCEL, URING_TIMER };
+#define URING_OP_MASK 7
+
+// Outcome of a group operation performed under the group's shard lock
+enum GroupResult { GROUP_OK, GROUP_MISSING, GROUP_NOT_MEMBER, GROUP_ALREADY_MEMBER, GROUP_EXISTS, GROUP_FULL };
+
+enum CommandKind { CMD_MSG, CMD_BROADCAST, CMD_CREATE_GROUP, CMD_JOIN_GROUP, CMD_LEAVE_GROUP, CMD_GROUP_MSG,
+                   CMD_PRESENCE, CMD_EXIT, CMD_INVALID, CMD_KINDS };
+constexpr string_view command_names[CMD_KINDS] = {"/msg", "/broadcast", "/create_group", "/join_group", "/leave_group",
+                                                 "/group_msg", "/presence", "/exit", "invalid"};
+#define COMMAND_TABLE_SIZE 16       // Slots of the command hash table (power of two)
+#define POOL_MIN_SHIFT 5            // Smallest pooled buffer is 2^5 bytes
+#define POOL_CLASSES 12             // Power-of-two size classes up to 64 KiB; larger buffers use the heap
+#define POOL_CHUNK_SIZE 256*1024    // Bytes carved into buffers when a size class runs dry
+#define POOL_BATCH 64               // Buffers moved between a thread cache and the shared depot at once
+#define POOL_CACHE_LIMIT 256        // Buffers a thread keeps per size class
+#define SLAB_CHUNK_SLOTS 256        // Connections per slab chunk
+#define MEMBERSET_DENSE_MIN 64      // Members a group needs before it may switch to a bitmap
+#define GROUP_SHARDS 64             // Independently locked parts of the group name table
+#define GROUP_CHUNK 1024            // Group slots allocated together
+#define MAX_GROUPS (1 << 20)        // Groups that can exist at once
+#define CLUSTER_QUEUE_LIMIT 64*1024*1024    // Bytes queued for a peer before its link is reset
+#define CLUSTER_RETRY_MS 1000       // Wait between attempts to connect to a peer
+#define FLUSH_QUANTUM 64*1024       // Bytes a connection may write before the next one gets a turn
+#define DEFAULT_PRESENCE_WINDOW 0   // Milliseconds join and leave notices are collected for; 0 sends each at once
+
+constexpr uint32_t command_hash(string_view name, uint32_t seed) {
+    uint32_t hash = seed;  // FNV-1a from a chosen seed
+    for (char c : name) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    return hash;
+}
+
+// The slot comes from the high bits: the low bits of FNV-1a depend only on the low bits of the seed
+constexpr uint32_t command_slot(string_view name, uint32_t seed) {
+    return (command_hash(name, seed) >> 16) % COMMAND_TABLE_SIZE;
+}
+
+// The first seed for which every command hashes to a slot of its own, found at compile time
+constexpr uint32_t find_command_seed() {
+    for (uint32_t seed = 1;; ++seed) {
+        bool used[COMMAND_TABLE_SIZE] = {};
+        bool perfect = true;
+        for (int kind = 0; kind < CMD_INVALID && perfect; ++kind) {
+            uint32_t slot = command_slot(command_names[kind], seed);
+            perfect = !used[slot];
+            used[slot] = true;
+        }
+        if (perfect) return seed;
+    }
+}
+constexpr uint32_t COMMAND_SEED = find_command_seed();
+
+constexpr array<CommandKind, COMMAND_TABLE_SIZE> build_command_table() {
+    array<CommandKind, COMMAND_TABLE_SIZE> table{};
+    for (CommandKind& slot : table) slot = CMD_INVALID;
+    for (int kind = 0; kind < CMD_INVALID; ++kind) {
+        table[command_slot(command_names[kind], COMMAND_SEED)] = (CommandKind)kind;
+    }
+    return table;
+}
+constexpr array<CommandKind, COMMAND_TABLE_SIZE> command_table = build_command_table();
+
+// Map a command word to its kind with one hash and one comparison
+inline CommandKind lookup_command(string_view name) {
+    CommandKind kind = command_table[command_slot(name, COMMAND_SEED)];
+    return kind != CMD_INVALID && command_names[kind] == name ? kind : CMD_INVALID;
+}
+
+// Locks whose wait times are measured
+enum LockClass { LOCK_CLIENTS, LOCK_GROUPS, LOCK_SESSIONS, LOCK_OUTQ, LOCK_PENDING, LOCK_LOG, LOCK_AUTH, LOCK_CLUSTER,
+                 LOCK_PRESENCE, LOCK_CLASSES };
+const char* lock_names[LOCK_CLASSES] = {"clients", "groups", "sessions", "outq", "pending", "log", "auth", "cluster", "presence"};
+
+// What pooled memory is used for, for the memory metrics
+enum MemoryUse { MEM_CONNECTIONS, MEM_INPUT, MEM_OUTQ, MEM_PAYLOADS, MEM_REGISTRIES, MEM_USES };
+const char* memory_names[MEM_USES] = {"connections", "input", "outq", "payloads", "registries"};
+
+#define HIST_BUCKETS 40
+
+// Counters have a single writer, the thread that owns them, so an increment is a relaxed
+// load and store rather than a locked read-modify-write. Other threads only read.
+inline void bump(atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Histogram with power-of-two buckets: bucket i counts values that need i bits (below 2^i)
+struct Histogram {
+    atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> sum{0};
+
+    void observe(uint64_t value) {
+        int bits = value ? 64 - __builtin_clzll(value) : 0;
+        bump(buckets[min(bits, HIST_BUCKETS - 1)]);
+        bump(count);
+        bump(sum, value);
+    }
+};
+
+// Metrics of one thread. Each reactor (and the acceptor) updates only its own block, so the
+// hot path never shares a cache line; the metrics endpoint sums the blocks when scraped.
+struct Metrics {
+    atomic<uint64_t> accepts{0};
+    atomic<uint64_t> closes{0};
+    atomic<uint64_t> auth_ok{0};
+    atomic<uint64_t> auth_failed{0};
+    atomic<uint64_t> auth_duplicate{0};
+    atomic<uint64_t> auth_busy{0};
+    atomic<uint64_t> login_timeouts{0};
+    atomic<uint64_t> login_rejected{0};
+    atomic<uint64_t> logouts{0};
+    atomic<uint64_t> commands[CMD_KINDS] = {};
+    atomic<uint64_t> bytes_received{0};
+    atomic<uint64_t> write_calls{0};
+    atomic<uint64_t> messages_written{0};
+    atomic<uint64_t> bytes_written{0};
+    atomic<uint64_t> dropped{0};
+    atomic<uint64_t> overflow_disconnects{0};
+    atomic<uint64_t> sender_pauses{0};
+    atomic<uint64_t> flush_yields{0};
+    atomic<uint64_t> rate_limited[CMD_KINDS] = {};
+    atomic<uint64_t> log_records{0};
+    atomic<uint64_t> log_bytes{0};
+    atomic<uint64_t> log_syncs{0};
+    atomic<uint64_t> log_replayed{0};
+    atomic<uint64_t> log_retired{0};
+    atomic<uint64_t> cluster_frames_sent{0};
+    atomic<uint64_t> cluster_bytes_sent{0};
+    atomic<uint64_t> cluster_frames_received{0};
+    atomic<uint64_t> cluster_bytes_received{0};
+    atomic<uint64_t> lock_acquisitions[LOCK_CLASSES] = {};
+    atomic<uint64_t> lock_contended[LOCK_CLASSES] = {};
+    // Gauges: a block may be allocated on one thread and freed on another, so a single
+    // block can go negative (wrapping); only the sum over all threads is meaningful
+    atomic<uint64_t> memory_bytes[MEM_USES] = {};
+    atomic<uint64_t> slab_reserved{0};          // Connection slab chunks taken from the heap
+    atomic<uint64_t> pool_reserved{0};          // Buffer pool chunks taken from the heap
+    Histogram handoff_ns;                   // Accept until the reactor registers the socket
+    Histogram auth_ns;                      // Accept until a successful login
+    Histogram auth_hash_ns;                 // Hashed password checks on the auth workers
+    Histogram command_ns[CMD_KINDS];        // Time to handle each command
+    Histogram fanout;                       // Recipients per sent message
+    Histogram queue_depth;                  // Outbound queue length after each enqueue
+    Histogram lock_wait_ns[LOCK_CLASSES];   // Contended acquisitions only
+    Histogram log_sync_ns;                  // One msync per batch of log records
+};
+
+mutex metrics_mutex;                        // Guards the list, not the counters
+vector<Metrics*> all_metrics;
+thread_local Metrics* thread_metrics = nullptr;
+
+// The calling thread's metrics block, created on first use and kept for the process lifetime
+Metrics& metrics() {
+    if (!thread_metrics) {
+        thread_metrics = new Metrics();
+        lock_guard<mutex> lock(metrics_mutex);
+        all_metrics.push_back(thread_metrics);
+    }
+    return *thread_metrics;
+}
+
+// Acquire a lock and record how long it waited. An uncontended acquisition costs a
+// try_lock and no clock reads.
+template <typename Lock>
+Lock timed_lock(typename Lock::mutex_type& m, LockClass lock_class) {
+    Lock lock(m, try_to_lock);
+    Metrics& stats = metrics();
+    bump(stats.lock_acquisitions[lock_class]);
+    if (!lock.owns_lock()) {
+        int64_t start = now_ns();
+        lock.lock();
+        bump(stats.lock_contended[lock_class]);
+        stats.lock_wait_ns[lock_class].observe(now_ns() - start);
+    }
+    return lock;
+}
+
+// Free memory is threaded through its own first word
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+// Size-class buffer pool for message payloads and the containers of connections and
+// registries. Each thread keeps a free list per power-of-two class and trades whole batches
+// with a shared depot, so allocating and freeing normally touch no lock and no other thread's
+// cache lines, even though buffers are often freed on another reactor than the one that
+// allocated them. Chunks are never returned to the heap: after a peak they are reused
+// instead of fragmenting it.
+class BufferPool {
+    struct ThreadCache {
+        FreeBlock* head;
+        size_t count;
+    };
+    struct alignas(64) Depot {
+        mutex batch_mutex;
+        vector<FreeBlock*> batches;     // Lists of POOL_BATCH buffers each
+    };
+    array<Depot, POOL_CLASSES> depots;
+    static thread_local ThreadCache caches[POOL_CLASSES];
+
+    static int size_class(size_t size) {
+        if (size <= (1u << POOL_MIN_SHIFT)) return 0;
+        return 64 - __builtin_clzll(size - 1) - POOL_MIN_SHIFT;
+    }
+    static size_t class_size(int cls) { return (size_t)1 << (cls + POOL_MIN_SHIFT); }
+
+    // Take a batch from the depot, or carve a new chunk when it has none
+    void refill(int cls, ThreadCache& cache) {
+        {
+            lock_guard<mutex> lock(depots[cls].batch_mutex);
+            if (!depots[cls].batches.empty()) {
+                cache.head = depots[cls].batches.back();
+                cache.count = POOL_BATCH;
+                depots[cls].batches.pop_back();
+                return;
+            }
+        }
+        size_t size = class_size(cls);
+        size_t count = max((size_t)1, (size_t)POOL_CHUNK_SIZE / size);
+        char* chunk = static_cast<char*>(::operator new(count * size));
+        bump(metrics().pool_reserved, count * size);
+        for (size_t i = count; i-- > 0;) {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + i * size);
+            block->next = cache.head;
+            cache.head = block;
+        }
+        cache.count += count;
+    }
+
+    // Hand a batch of a full cache back to the depot
+    void spill(int cls, ThreadCache& cache) {
+        FreeBlock* batch = cache.head;
+        FreeBlock* last = batch;
+        for (int i = 1; i < POOL_BATCH; ++i) last = last->next;
+        cache.head = last->next;
+        cache.count -= POOL_BATCH;
+        last->next = nullptr;
+        lock_guard<mutex> lock(depots[cls].batch_mutex);
+        depots[cls].batches.push_back(batch);
+    }
+
+public:
+    void* allocate(size_t size, MemoryUse use) {
+        int cls = size_class(size);
+        if (cls >= POOL_CLASSES) {
+            bump(metrics().memory_bytes[use], size);
+            return ::operator new(size);
+        }
+        bump(metrics().memory_bytes[use], class_size(cls));
+        ThreadCache& cache = caches[cls];
+        if (!cache.head) refill(cls, cache);
+        FreeBlock* block = cache.head;
+        cache.head = block->next;
+        cache.count--;
+        return block;
+    }
+
+    // size must be the size that was allocated
+    void deallocate(void* pointer, size_t size, MemoryUse use) {
+        int cls = size_class(size);
+        if (cls >= POOL_CLASSES) {
+            bump(metrics().memory_bytes[use], -size);
+            ::operator delete(pointer);
+            return;
+        }
+        bump(metrics().memory_bytes[use], -class_size(cls));
+        ThreadCache& cache = caches[cls];
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        block->next = cache.head;
+        cache.head = block;
+        if (++cache.count > POOL_CACHE_LIMIT) spill(cls, cache);
+    }
+};
+thread_local BufferPool::ThreadCache BufferPool::caches[POOL_CLASSES];
+BufferPool buffer_pool;
+
+// Standard allocator over buffer_pool, for containers whose memory is reported as `use`
+template <typename T, MemoryUse use>
+struct PoolAllocator {
+    typedef T value_type;
+    template <typename U> struct rebind { typedef PoolAllocator<U, use> other; };
+
+    PoolAllocator() = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U, use>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(buffer_pool.allocate(n * sizeof(T), use)); }
+    void deallocate(T* pointer, size_t n) { buffer_pool.deallocate(pointer, n * sizeof(T), use); }
+    template <typename U> bool operator==(const PoolAllocator<U, use>&) const { return true; }
+};
+
+typedef basic_string<char, char_traits<char>, PoolAllocator<char, MEM_INPUT>> InputBuffer;
+
+// Fixed-size slots for the connections of one reactor. Only the owning reactor allocates,
+// but the last reference to a connection may be dropped on any thread, so frees from other
+// threads go onto a lock-free list that the owner takes over in one exchange once its own
+// list runs dry. Pushing never needs to guard against ABA since nothing pops concurrently.
+class Slab {
+    size_t slot_size = 0;           // Set by the first allocation
+    FreeBlock* local = nullptr;     // Owner thread only
+    atomic<FreeBlock*> remote{nullptr};
+
+public:
+    void* allocate(size_t size) {
+        if (!slot_size) slot_size = (size + 63) & ~(size_t)63;
+        if (size > slot_size) return ::operator new(size);
+        if (!local) local = remote.exchange(nullptr, memory_order_acquire);
+        if (!local) {
+            char* chunk = static_cast<char*>(::operator new(slot_size * SLAB_CHUNK_SLOTS, align_val_t(64)));
+            bump(metrics().slab_reserved, slot_size * SLAB_CHUNK_SLOTS);
+            for (size_t i = SLAB_CHUNK_SLOTS; i-- > 0;) {
+                FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + i * slot_size);
+                block->next = local;
+                local = block;
+            }
+        }
+        FreeBlock* block = local;
+        local = block->next;
+        bump(metrics().memory_bytes[MEM_CONNECTIONS], slot_size);
+        return block;
+    }
+
+    void deallocate(void* pointer, size_t size) {
+        if (size > slot_size) {
+            ::operator delete(pointer);
+            return;
+        }
+        bump(metrics().memory_bytes[MEM_CONNECTIONS], -slot_size);
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        if (current_slab == this) {
+            block->next = local;
+            local = block;
+            return;
+        }
+        block->next = remote.load(memory_order_relaxed);
+        while (!remote.compare_exchange_weak(block->next, block, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+
+    static thread_local Slab* current_slab;     // The slab owned by the calling thread, if any
+};
+thread_local Slab* Slab::current_slab = nullptr;
+
+// Allocator for allocate_shared that places a connection and its control block in a slab slot
+template <typename T>
+struct SlabAllocator {
+    typedef T value_type;
+    Slab* slab;
+
+    explicit SlabAllocator(Slab* slab) : slab(slab) {}
+    template <typename U> SlabAllocator(const SlabAllocator<U>& other) : slab(other.slab) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(slab->allocate(n * sizeof(T))); }
+    void deallocate(T* pointer, size_t n) { slab->deallocate(pointer, n * sizeof(T)); }
+    template <typename U> bool operator==(const SlabAllocator<U>& other) const { return slab == other.slab; }
+};
+
+// A hash map split into independently locked shards. Lookups take a shared lock on one
+// shard only, so readers never serialize with each other and writers only with their shard.
+template <typename K, typename V, size_t SHARDS = 64>
+class ShardedMap {
+    // Transparent, so string keys can be looked up with a string_view without a copy
+    struct KeyHash {
+        using is_transparent = void;
+        using Hashed = conditional_t<is_same_v<K, string>, string_view, K>;
+        size_t operator()(const Hashed& key) const { return hash<Hashed>{}(key); }
+    };
+    typedef unordered_map<K, V, KeyHash, equal_to<>, PoolAllocator<pair<const K, V>, MEM_REGISTRIES>> Map;
+    struct alignas(64) Shard {
+        mutable shared_mutex mutex;
+        Map map;
+    };
+    array<Shard, SHARDS> shards;
+    LockClass lock_class;
+
+    template <typename Q> Shard& shard_for(const Q& key) { return shards[KeyHash{}(key) % SHARDS]; }
+    template <typename Q> const Shard& shard_for(const Q& key) const { return shards[KeyHash{}(key) % SHARDS]; }
+
+public:
+    explicit ShardedMap(LockClass lock_class) : lock_class(lock_class) {}
+
+    // Call f(value) under a shared lock if key is present. Returns whether it was.
+    template <typename Q, typename F>
+    bool read(const Q& key, F&& f) const {
+        const Shard& shard = shard_for(key);
+        auto lock = timed_lock<shared_lock<shared_mutex>>(shard.mutex, lock_class);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) return false;
+        f(it->second);
+        return true;
+    }
+
+    // Call f(map) with exclusive access to the shard that holds key, returning its result
+    template <typename Q, typename F>
+    auto write(const Q& key, F&& f) {
+        Shard& shard = shard_for(key);
+        auto lock = timed_lock<unique_lock<shared_mutex>>(shard.mutex, lock_class);
+        return f(shard.map);
+    }
+
+    // Call f(key, value) for every entry, holding one shard's shared lock at a time
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const Shard& shard : shards) {
+            auto lock = timed_lock<shared_lock<shared_mutex>>(shard.mutex, lock_class);
+            for (const auto& entry : shard.map) {
+                f(entry.first, entry.second);
+            }
+        }
+    }
+
+    void insert_or_assign(const K& key, V value) {
+        write(key, [&](Map& map) { map.insert_or_assign(key, std::move(value)); });
+    }
+
+    bool erase(const K& key) {
+        return write(key, [&](Map& map) { return map.erase(key) > 0; });
+    }
+};
+
+// What to do when a message is queued for a client whose outbound queue is full
+enum OverflowPolicy { OVERFLOW_DROP, OVERFLOW_DISCONNECT, OVERFLOW_BACKPRESSURE };
+
+void encode_frame_header(char* header, uint32_t length) {
+    header[0] = (char)(length >> 24);
+    header[1] = (char)(length >> 16);
+    header[2] = (char)(length >> 8);
+    header[3] = (char)length;
+}
+
+uint32_t decode_frame_header(const char* header) {
+    const unsigned char* h = (const unsigned char*)header;
+    return (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | (uint32_t)h[3];
+}
+
+// An immutable, reference-counted message shared by every recipient of a fan-out. The text
+// is formatted once into a single allocation that holds the reference count, the length and
+// FRAME_HEADER_SIZE bytes of headroom with the frame header already written, so framed and
+// text-mode clients are served from the same bytes without copying.
+class Payload {
+    struct Buffer {
+        atomic<uint32_t> refs;
+        uint32_t length;
+        char* bytes() { return reinterpret_cast<char*>(this + 1); }
+    };
+    Buffer* buffer = nullptr;
+
+public:
+    Payload() = default;
+    Payload(initializer_list<string_view> parts) {
+        size_t length = 0;
+        for (string_view part : parts) length += part.size();
+        buffer = static_cast<Buffer*>(buffer_pool.allocate(sizeof(Buffer) + FRAME_HEADER_SIZE + length, MEM_PAYLOADS));
+        new (buffer) Buffer{{1}, (uint32_t)length};
+        encode_frame_header(buffer->bytes(), length);
+        char* out = buffer->bytes() + FRAME_HEADER_SIZE;
+        for (string_view part : parts) {
+            memcpy(out, part.data(), part.size());
+            out += part.size();
+        }
+    }
+    Payload(const Payload& other) : buffer(other.buffer) {
+        if (buffer) buffer->refs.fetch_add(1, memory_order_relaxed);
+    }
+    Payload(Payload&& other) noexcept : buffer(other.buffer) { other.buffer = nullptr; }
+    Payload& operator=(Payload other) noexcept {
+        swap(buffer, other.buffer);
+        return *this;
+    }
+    ~Payload() { reset(); }
+
+    void reset() {
+        if (buffer && buffer->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            size_t size = sizeof(Buffer) + FRAME_HEADER_SIZE + buffer->length;
+            buffer->~Buffer();
+            buffer_pool.deallocate(buffer, size, MEM_PAYLOADS);
+        }
+        buffer = nullptr;
+    }
+    const char* frame() const { return buffer->bytes(); }  // Frame header followed by the text
+    const char* data() const { return buffer->bytes() + FRAME_HEADER_SIZE; }
+    size_t size() const { return buffer->length; }
+};
+
+// Minimal io_uring over the raw syscalls: the mapped submission and completion rings plus
+// one provided-buffer ring that multishot receives take their buffers from.
+struct Uring {
+    int fd = -1;
+    unsigned sq_entries = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned to_submit = 0;         // Entries queued since the last io_uring_enter
+    deque<io_uring_sqe> overflow;   // Entries waiting for room in a full submission queue
+    io_uring_buf* buf_ring = nullptr;   // The ring tail overlays bufs[0].resv
+    unsigned short buf_tail = 0;
+    vector<char> buffers;
+
+    // Returns false when the kernel does not offer what the backend needs
+    bool setup() {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = URING_ENTRIES * 4;  // Multishot receives post many completions
+        fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (fd < 0) return false;
+        if (!(params.features & IORING_FEAT_NODROP)) return false;
+
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_size = cq_size = max(sq_size, cq_size);
+        char* sq = (char*)mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) return false;
+        char* cq = single_mmap ? sq : (char*)mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (cq == MAP_FAILED || sqes == MAP_FAILED) return false;
+
+        sq_entries = params.sq_entries;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        // Register the receive buffers (needs Linux 5.19; multishot receive needs 6.0)
+        buf_ring = (io_uring_buf*)mmap(nullptr, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED) return false;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = URING_BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+        buffers.resize((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+        for (unsigned short bid = 0; bid < URING_BUFFERS; ++bid) {
+            recycle_buffer(bid);
+        }
+        return true;
+    }
+
+    bool sq_full() const {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries;
+    }
+
+    // Next free submission entry, zeroed. Submits what is queued if the ring is full. If the
+    // kernel cannot take it yet (EBUSY until the reactor reaps completions), the entry waits
+    // in overflow instead, and so do all later ones, to keep their order.
+    io_uring_sqe* get_sqe() {
+        if (overflow.empty() && sq_full()) {
+            enter(0);
+        }
+        if (!overflow.empty() || sq_full()) {
+            overflow.emplace_back();  // Zeroed; deque entries stay put as it grows
+            return &overflow.back();
+        }
+        return next_slot();
+    }
+
+    // Move the entries that waited for room into the ring. Returns true if some still wait.
+    bool flush_overflow() {
+        while (!overflow.empty() && !sq_full()) {
+            *next_slot() = overflow.front();
+            overflow.pop_front();
+        }
+        return !overflow.empty();
+    }
+
+    // Claim the next slot of the ring, zeroed
+    io_uring_sqe* next_slot() {
+        unsigned tail = *sq_tail;
+        io_uring_sqe* sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        return sqe;
+    }
+
+    // Submit everything queued in one system call and wait for min_complete completions
+    int enter(unsigned min_complete) {
+        int ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret > 0) to_submit -= ret;
+        return ret;
+    }
+
+    ~Uring() {
+        if (fd >= 0) close(fd);
+    }
+
+    char* buffer(unsigned short bid) { return buffers.data() + (size_t)bid * URING_BUFFER_SIZE; }
+
+    // Give a receive buffer back to the kernel
+    void recycle_buffer(unsigned short bid) {
+        // Not io_uring_buf_ring::bufs: in C++ its flexible-array wrapper shifts the entries
+        io_uring_buf* buf = &buf_ring[buf_tail & (URING_BUFFERS - 1)];
+        buf->addr = (uint64_t)buffer(bid);
+        buf->len = URING_BUFFER_SIZE;
+        buf->bid = bid;
+        __atomic_store_n(&buf_ring[0].resv, ++buf_tail, __ATOMIC_RELEASE);
+    }
+};
+
+// A sendmsg in flight on io_uring. It owns references to the payloads it points into, so
+// a disconnect can drop the queue while the kernel still reads them.
+struct UringSend {
+    msghdr msg{};
+    iovec iov[WRITE_BATCH];
+    Payload payloads[WRITE_BATCH];
+};
+
+struct Reactor;
+struct UserBuckets;
+
+typedef vector<Payload, PoolAllocator<Payload, MEM_OUTQ>> OutQueue;
+
+// Per-connection state. A connection is owned by exactly one reactor thread, which is the
+// only thread that reads from it or writes to its socket. Any thread may queue output for
+// it through send_all; the owning reactor drains the queue asynchronously.
+struct Client : enable_shared_from_this<Client> {
+    int socket;
+    Reactor* reactor;
+    ClientState state = AWAIT_USERNAME;
+    string username;
+    bool framed = false;    // Set once the client negotiated the framed protocol (under out_mutex)
+    InputBuffer inbuf;      // Reassembly buffer for partial frames (reactor thread only)
+    int64_t accepted_ns = 0;        // When the connection was accepted, for the auth latency
+    vector<uint32_t> groups;        // IDs of the groups this client is a member of (reactor thread only)
+    bool read_paused = false;       // Stopped reading because of backpressure (reactor thread only)
+    atomic<int> pause_count{0};     // Number of full queues this client is waiting on
+    atomic<bool> replaying{false};  // The message log is still streaming this user's backlog
+    vector<string> deferred_input;  // Sent while the password was being verified (reactor thread only)
+    shared_ptr<UserBuckets> buckets;    // Rate limits, shared by all of the user's sessions (set at login)
+    atomic<bool> presence{true};    // Receives join and leave notices (/presence on|off)
+
+    mutex out_mutex;        // Guards the outbound queue and everything down to closed
+    OutQueue outq;          // Ring of queued messages, grown on demand (power of two)
+    size_t out_head = 0;
+    size_t out_count = 0;
+    size_t out_offset = 0;  // Bytes of the head message already written, frame header included
+    size_t unframed = 0;    // Head messages queued before framing was negotiated, still sent as text
+    bool zerocopy = false;  // SO_ZEROCOPY is enabled on the socket
+    uint32_t zc_next = 0;   // Sequence number of the next MSG_ZEROCOPY send
+    deque<pair<uint32_t, Payload>> zc_inflight;  // Payloads the kernel may still be reading
+    bool flush_scheduled = false;
+    bool overflowed = false;        // Queue overflowed; the owner disconnects the client
+    vector<shared_ptr<Client>> blocked_senders;  // Clients paused until this queue drains
+    bool closed = false;
+
+    // io_uring backend only (reactor thread)
+    bool recv_armed = false;        // A multishot receive is outstanding
+    bool recv_eof = false;          // The peer closed while input was held
+    deque<string> held_input;       // Reads that arrived while paused, handled on resume
+    bool send_armed = false;        // uring_send is in flight (guarded by out_mutex)
+    unique_ptr<UringSend> uring_send;
+    int uring_ops = 0;              // Outstanding operations whose user_data points here
+    shared_ptr<Client> uring_pin;   // Keeps the client alive until they complete
+
+    Client(int socket, Reactor* reactor) : socket(socket), reactor(reactor) {}
+};
+
+// A password check finished by an auth worker
+struct AuthResult {
+    shared_ptr<Client> client;
+    bool ok;
+};
+
+// A socket accepted for a reactor, with the time it was accepted
+struct Accepted {
+    int socket;
+    int64_t accepted_ns;
+};
+
+// A connection that must log in by the deadline
+struct Handshake {
+    int64_t deadline_ns;
+    weak_ptr<Client> client;
+};
+
+// An epoll instance driven by one thread. Other threads hand it new sockets, clients with
+// queued output and clients to resume through the pending lists and the wake_fd eventfd.
+struct Reactor {
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    int listen_fd = -1;             // Own SO_REUSEPORT listener, if accepting for itself
+    int timer_fd = -1;              // Fires at the earliest handshake deadline
+    unique_ptr<Uring> uring;        // Set when this reactor runs on io_uring instead of epoll
+    bool sends_submitted = false;   // Sends were queued on the ring since the last enter
+    mutex pending_mutex;
+    bool woken = false;             // wake_fd already signalled for the current pending lists
+    vector<Accepted> pending_sockets;
+    vector<shared_ptr<Client>> pending_flush;
+    vector<shared_ptr<Client>> pending_resume;
+    vector<AuthResult> pending_auth;
+    unordered_map<int, shared_ptr<Client>> connections;  // Only touched by the reactor thread
+    Slab slab;                      // Memory of this reactor's connections
+    deque<Handshake> handshakes;    // In deadline order, since every connection gets the same timeout
+};
+
+// SHA-256 (FIPS 180-4), for hashing passwords without an external crypto library
+struct Sha256 {
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block[64];
+    size_t used = 0;
+    uint64_t length = 0;
+
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* data) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    void update(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        length += size;
+        while (size > 0) {
+            size_t n = min(size, 64 - used);
+            memcpy(block + used, bytes, n);
+            used += n;
+            bytes += n;
+            size -= n;
+            if (used == 64) {
+                compress(block);
+                used = 0;
+            }
+        }
+    }
+
+    void finish(unsigned char* digest) {
+        uint64_t bits = length * 8;
+        block[used++] = 0x80;
+        if (used > 56) {
+            memset(block + used, 0, 64 - used);
+            compress(block);
+            used = 0;
+        }
+        memset(block + used, 0, 56 - used);
+        for (int i = 0; i < 8; ++i) {
+            block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+        }
+        compress(block);
+        digest_of(digest);
+    }
+
+    void digest_of(unsigned char* digest) const {
+        for (int i = 0; i < 8; ++i) {
+            digest[4 * i] = (unsigned char)(state[i] >> 24);
+            digest[4 * i + 1] = (unsigned char)(state[i] >> 16);
+            digest[4 * i + 2] = (unsigned char)(state[i] >> 8);
+            digest[4 * i + 3] = (unsigned char)state[i];
+        }
+    }
+};
+
+// PBKDF2-HMAC-SHA256 with a single 32-byte output block. The HMAC key pads are absorbed
+// once and every later HMAC input is one 32-byte digest, so each iteration is exactly two
+// compressions of a pre-padded block.
+void pbkdf2_sha256(string_view password, const unsigned char* salt, size_t salt_length,
+                   uint32_t iterations, unsigned char* out) {
+    unsigned char key[64] = {};
+    if (password.size() > 64) {
+        Sha256 hashed;
+        hashed.update(password.data(), password.size());
+        hashed.finish(key);
+    } else {
+        memcpy(key, password.data(), password.size());
+    }
+    unsigned char pad[64];
+    Sha256 inner, outer;
+    for (int i = 0; i < 64; ++i) pad[i] = key[i] ^ 0x36;
+    inner.update(pad, 64);
+    for (int i = 0; i < 64; ++i) pad[i] = key[i] ^ 0x5c;
+    outer.update(pad, 64);
+
+    unsigned char u[32], digest[32];
+    const unsigned char block_index[4] = {0, 0, 0, 1};
+    Sha256 context = inner;
+    context.update(salt, salt_length);
+    context.update(block_index, 4);
+    context.finish(digest);
+    context = outer;
+    context.update(digest, 32);
+    context.finish(u);
+    memcpy(out, u, 32);
+
+    // A 32-byte message after the 64-byte pad block: 0x80, zeros, then 768 as the bit length
+    unsigned char block[64] = {};
+    block[32] = 0x80;
+    block[62] = 0x03;
+    for (uint32_t i = 1; i < iterations; ++i) {
+        memcpy(block, u, 32);
+        context = inner;
+        context.compress(block);
+        context.digest_of(block);
+        context = outer;
+        context.compress(block);
+        context.digest_of(u);
+        for (int j = 0; j < 32; ++j) out[j] ^= u[j];
+    }
+}
+
+uint64_t name_hash(string_view name) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (unsigned char c : name) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Credential index file: a header, an open-addressing table of fixed-size slots indexed by
+// the username hash, then the usernames. It is mapped and used in place, so startup does
+// no parsing regardless of the number of users.
+#define CREDENTIAL_MAGIC "CHATCRD1"
+#define SALT_SIZE 16
+#define DEFAULT_ITERATIONS 10000
+
+struct CredentialHeader {
+    char magic[8];
+    uint32_t iterations;
+    uint32_t slot_count;        // Power of two, at least twice the user count
+    uint64_t user_count;
+};
+
+struct CredentialSlot {
+    uint64_t hash;
+    uint32_t name_offset;       // From the start of the file
+    uint32_t name_length;       // 0 for an empty slot
+    unsigned char salt[SALT_SIZE];
+    unsigned char key[32];      // PBKDF2-HMAC-SHA256(password, salt, iterations)
+};
+
+// The set of valid logins: either the plaintext users file (the original format) or a
+// mapped credential index with salted password hashes. Replaced as a whole on reload.
+class Credentials {
+    unordered_map<string, string> plain;   // Username → Password, for the text format
+    char* base = nullptr;
+    size_t length = 0;
+    const CredentialHeader* header = nullptr;
+    const CredentialSlot* slots = nullptr;
+
+    const CredentialSlot* find(string_view name) const {
+        uint64_t hash = name_hash(name);
+        uint32_t mask = header->slot_count - 1;
+        for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+            const CredentialSlot& slot = slots[i];
+            if (slot.name_length == 0) return nullptr;
+            if (slot.hash == hash && string_view(base + slot.name_offset, slot.name_length) == name) return &slot;
+        }
+    }
+
+public:
+    Credentials() = default;
+    Credentials(const Credentials&) = delete;
+    Credentials& operator=(const Credentials&) = delete;
+    ~Credentials() {
+        if (base) munmap(base, length);
+    }
+
+    static shared_ptr<Credentials> load_text(const string& path) {
+        auto credentials = make_shared<Credentials>();
+        ifstream file(path);
+        string line;
+        while (getline(file, line)) {
+            size_t colon = line.find(':');
+            if (colon != string::npos) {
+                credentials->plain[line.substr(0, colon)] = line.substr(colon + 1);
+            }
+        }
+        return credentials;
+    }
+
+    static shared_ptr<Credentials> load_index(const string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            cerr << "Error: Cannot open credential index " << path << ": " << strerror(errno) << endl;
+            return nullptr;
+        }
+        struct stat info;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(CredentialHeader)) {
+            data = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            cerr << "Error: Cannot map credential index " << path << endl;
+            return nullptr;
+        }
+        auto credentials = make_shared<Credentials>();
+        credentials->base = static_cast<char*>(data);
+        credentials->length = info.st_size;
+        credentials->header = static_cast<const CredentialHeader*>(data);
+        credentials->slots = reinterpret_cast<const CredentialSlot*>(credentials->base + sizeof(CredentialHeader));
+        const CredentialHeader& header = *credentials->header;
+        uint32_t slot_count = header.slot_count;
+        if (memcmp(header.magic, CREDENTIAL_MAGIC, 8) != 0 || slot_count == 0 || (slot_count & (slot_count - 1)) ||
+            header.user_count >= slot_count || header.iterations == 0 ||
+            sizeof(CredentialHeader) + (uint64_t)slot_count * sizeof(CredentialSlot) > credentials->length) {
+            cerr << "Error: " << path << " is not a valid credential index." << endl;
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < slot_count; ++i) {
+            const CredentialSlot& slot = credentials->slots[i];
+            if ((uint64_t)slot.name_offset + slot.name_length > credentials->length) {
+                cerr << "Error: " << path << " is not a valid credential index." << endl;
+                return nullptr;
+            }
+        }
+        return credentials;
+    }
+
+    bool hashed() const { return header != nullptr; }
+    size_t size() const { return header ? header->user_count : plain.size(); }
+
+    bool contains(string_view name) const {
+        if (!header) return plain.count(string(name)) > 0;
+        return find(name) != nullptr;
+    }
+
+    // Check a password. With the index this is deliberately expensive and should run on an
+    // auth worker; an unknown user costs the same as a wrong password.
+    bool verify(string_view name, string_view password) const {
+        if (!header) {
+            auto it = plain.find(string(name));
+            return it != plain.end() && it->second == password;
+        }
+        const CredentialSlot* slot = find(name);
+        static const CredentialSlot unknown{};
+        const CredentialSlot& target = slot ? *slot : unknown;
+        unsigned char key[32];
+        pbkdf2_sha256(password, target.salt, SALT_SIZE, header->iterations, key);
+        unsigned char difference = 0;
+        for (int i = 0; i < 32; ++i) difference |= key[i] ^ target.key[i];
+        return slot && difference == 0;
+    }
+};
+
+// Convert a users file into a credential index, hashing on every core. The index is written
+// next to its destination and renamed into place, so a running server can reload it safely.
+bool build_credentials(const string& input, const string& output, uint32_t iterations) {
+    vector<pair<string, string>> entries;
+    {
+        ifstream file(input);
+        if (!file) {
+            cerr << "Error: Cannot read " << input << endl;
+            return false;
+        }
+        unordered_set<string> seen;
+        string line;
+        while (getline(file, line)) {
+            size_t colon = line.find(':');
+            if (colon != string::npos && colon > 0 && seen.insert(line.substr(0, colon)).second) {
+                entries.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+            }
+        }
+    }
+    uint32_t slot_count = 2;
+    while (slot_count < entries.size() * 2) slot_count *= 2;
+
+    vector<CredentialSlot> slots(slot_count);
+    vector<CredentialSlot> hashed(entries.size());
+    atomic<size_t> next{0};
+    auto hash_entries = [&] {
+        for (size_t i; (i = next++) < entries.size();) {
+            CredentialSlot& slot = hashed[i];
+            if (getrandom(slot.salt, SALT_SIZE, 0) != SALT_SIZE) {
+                cerr << "Error: getrandom failed." << endl;
+                exit(1);
+            }
+            pbkdf2_sha256(entries[i].second, slot.salt, SALT_SIZE, iterations, slot.key);
+        }
+    };
+    vector<thread> workers;
+    for (unsigned i = 0; i < max(1u, thread::hardware_concurrency()); ++i) {
+        workers.emplace_back(hash_entries);
+    }
+    for (thread& worker : workers) worker.join();
+
+    string names;
+    uint64_t names_start = sizeof(CredentialHeader) + (uint64_t)slot_count * sizeof(CredentialSlot);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const string& name = entries[i].first;
+        CredentialSlot& slot = hashed[i];
+        slot.hash = name_hash(name);
+        slot.name_offset = names_start + names.size();
+        slot.name_length = name.size();
+        names += name;
+        uint32_t position = slot.hash & (slot_count - 1);
+        while (slots[position].name_length != 0) position = (position + 1) & (slot_count - 1);
+        slots[position] = slot;
+    }
+
+    CredentialHeader header{};
+    memcpy(header.magic, CREDENTIAL_MAGIC, 8);
+    header.iterations = iterations;
+    header.slot_count = slot_count;
+    header.user_count = entries.size();
+    string temporary = output + ".tmp";
+    ofstream file(temporary, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(CredentialSlot));
+    file.write(names.data(), names.size());
+    file.close();
+    if (!file || rename(temporary.c_str(), output.c_str()) < 0) {
+        cerr << "Error: Cannot write " << output << endl;
+        return false;
+    }
+    cout << "Wrote " << entries.size() << " users to " << output << " (" << iterations << " iterations)" << endl;
+    return true;
+}
+
+// The sockets of a group's connected members. A small or sparse group keeps them in a sorted
+// vector; once a bitmap over the descriptors would take no more memory the group switches to
+// one, and back when it thins out. Either way a fan-out is a linear scan of contiguous memory.
+class MemberSet {
+    vector<int, PoolAllocator<int, MEM_REGISTRIES>> sorted;
+    vector<uint64_t, PoolAllocator<uint64_t, MEM_REGISTRIES>> bits;  // In use when not empty
+    size_t count = 0;
+
+    bool dense() const { return !bits.empty(); }
+
+    // Switch to whichever representation is smaller, with a factor of two of hysteresis
+    void rebalance() {
+        if (!dense() && count >= MEMBERSET_DENSE_MIN &&
+            (size_t)(sorted.back() / 64 + 1) * sizeof(uint64_t) <= count * sizeof(int)) {
+            bits.assign(sorted.back() / 64 + 1, 0);
+            for (int socket : sorted) bits[socket / 64] |= 1ull << (socket % 64);
+            decltype(sorted)().swap(sorted);
+        } else if (dense() && count * sizeof(int) * 2 < bits.size() * sizeof(uint64_t)) {
+            sorted.reserve(count);
+            for_each([&](int socket) { sorted.push_back(socket); });
+            decltype(bits)().swap(bits);
+        }
+    }
+
+public:
+    bool insert(int socket) {
+        if (dense()) {
+            if ((size_t)socket / 64 >= bits.size()) bits.resize(socket / 64 + 1, 0);
+            uint64_t bit = 1ull << (socket % 64);
+            if (bits[socket / 64] & bit) return false;
+            bits[socket / 64] |= bit;
+        } else {
+            auto it = lower_bound(sorted.begin(), sorted.end(), socket);
+            if (it != sorted.end() && *it == socket) return false;
+            sorted.insert(it, socket);
+        }
+        count++;
+        rebalance();
+        return true;
+    }
+
+    bool erase(int socket) {
+        if (dense()) {
+            uint64_t bit = 1ull << (socket % 64);
+            if ((size_t)socket / 64 >= bits.size() || !(bits[socket / 64] & bit)) return false;
+            bits[socket / 64] &= ~bit;
+        } else {
+            auto it = lower_bound(sorted.begin(), sorted.end(), socket);
+            if (it == sorted.end() || *it != socket) return false;
+            sorted.erase(it);
+        }
+        count--;
+        rebalance();
+        return true;
+    }
+
+    bool contains(int socket) const {
+        if (dense()) {
+            return (size_t)socket / 64 < bits.size() && (bits[socket / 64] >> (socket % 64) & 1);
+        }
+        return binary_search(sorted.begin(), sorted.end(), socket);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Call f(socket) for every member, in ascending order
+    template <typename F>
+    void for_each(F&& f) const {
+        if (!dense()) {
+            for (int socket : sorted) f(socket);
+            return;
+        }
+        for (size_t index = 0; index < bits.size(); ++index) {
+            for (uint64_t word = bits[index]; word; word &= word - 1) {
+                f((int)(index * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+};
+
+// A chat group: the connected members, with the message log also the usernames that belong
+// to it while offline, and in cluster mode the members connected to other nodes. The group
+// lives until all of them are empty.
+struct Group {
+    string name;
+    MemberSet sockets;
+    unordered_set<string> members;
+    map<int, unordered_set<string>> remote;     // Node → usernames
+
+    bool unused() const { return sockets.empty() && members.empty() && remote.empty(); }
+};
+
+// Groups by interned ID. A group's name is hashed once per command: the hash picks the shard
+// (high bits) and the start of a linear probe (low bits) in that shard's table of 16-byte
+// entries, which keep the hash so the table grows without hashing names again. The groups
+// themselves live in slots indexed by ID, and clients remember their groups by ID.
+class GroupTable {
+    struct Entry {
+        uint64_t hash;
+        uint32_t id;            // EMPTY_ID when the entry is free
+    };
+    static constexpr uint32_t EMPTY_ID = UINT32_MAX;
+    struct alignas(64) Shard {
+        mutable shared_mutex mutex;
+        vector<Entry> entries;  // Power-of-two size, at most half full
+        size_t count = 0;
+    };
+    array<Shard, GROUP_SHARDS> shards;
+    array<atomic<Group*>, MAX_GROUPS / GROUP_CHUNK> chunks{};
+    mutex id_mutex;             // Guards free_ids and next_id
+    vector<uint32_t> free_ids;
+    uint32_t next_id = 0;
+
+    Group& slot(uint32_t id) const { return chunks[id / GROUP_CHUNK].load(memory_order_acquire)[id % GROUP_CHUNK]; }
+    Shard& shard_for(uint64_t hash) { return shards[(hash >> 32) % GROUP_SHARDS]; }
+    const Shard& shard_for(uint64_t hash) const { return shards[(hash >> 32) % GROUP_SHARDS]; }
+
+    // Index of the entry for name, or of the free entry where it belongs
+    size_t find(const Shard& shard, uint64_t hash, string_view name) const {
+        size_t mask = shard.entries.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            const Entry& entry = shard.entries[i];
+            if (entry.id == EMPTY_ID || (entry.hash == hash && slot(entry.id).name == name)) return i;
+        }
+    }
+
+    void grow(Shard& shard) {
+        vector<Entry> old(shard.entries.size() * 2, Entry{0, EMPTY_ID});
+        old.swap(shard.entries);
+        size_t mask = shard.entries.size() - 1;
+        for (const Entry& entry : old) {
+            if (entry.id == EMPTY_ID) continue;
+            size_t i = entry.hash & mask;
+            while (shard.entries[i].id != EMPTY_ID) i = (i + 1) & mask;
+            shard.entries[i] = entry;
+        }
+    }
+
+    // Remove an entry, moving later entries of the probe sequence back so no tombstones are needed
+    void remove(Shard& shard, size_t hole) {
+        size_t mask = shard.entries.size() - 1;
+        for (size_t i = (hole + 1) & mask; shard.entries[i].id != EMPTY_ID; i = (i + 1) & mask) {
+            size_t home = shard.entries[i].hash & mask;
+            if (((i - home) & mask) >= ((i - hole) & mask)) {
+                shard.entries[hole] = shard.entries[i];
+                hole = i;
+            }
+        }
+        shard.entries[hole].id = EMPTY_ID;
+        shard.count--;
+    }
+
+    uint32_t allocate_id() {
+        lock_guard<mutex> lock(id_mutex);
+        if (!free_ids.empty()) {
+            uint32_t id = free_ids.back();
+            free_ids.pop_back();
+            return id;
+        }
+        if (next_id == MAX_GROUPS) return EMPTY_ID;
+        if (next_id % GROUP_CHUNK == 0) {
+            chunks[next_id / GROUP_CHUNK].store(new Group[GROUP_CHUNK], memory_order_release);
+        }
+        return next_id++;
+    }
+
+public:
+    GroupTable() {
+        for (Shard& shard : shards) shard.entries.assign(16, Entry{0, EMPTY_ID});
+    }
+
+    // Call f(group) under a shared lock if the group exists. Returns whether it does.
+    template <typename F>
+    bool read(string_view name, F&& f) const {
+        uint64_t hash = std::hash<string_view>{}(name);
+        const Shard& shard = shard_for(hash);
+        auto lock = timed_lock<shared_lock<shared_mutex>>(shard.mutex, LOCK_GROUPS);
+        const Entry& entry = shard.entries[find(shard, hash, name)];
+        if (entry.id == EMPTY_ID) return false;
+        f(slot(entry.id));
+        return true;
+    }
+
+    // Call f(id, group, created) with exclusive access to the group and return its result.
+    // With create a missing group is created first (GROUP_FULL when no ID is left); without,
+    // a missing group is GROUP_MISSING. A group f leaves empty is deleted and its ID reused.
+    template <typename F>
+    GroupResult modify(string_view name, bool create, F&& f) {
+        uint64_t hash = std::hash<string_view>{}(name);
+        Shard& shard = shard_for(hash);
+        auto lock = timed_lock<unique_lock<shared_mutex>>(shard.mutex, LOCK_GROUPS);
+        size_t index = find(shard, hash, name);
+        bool created = shard.entries[index].id == EMPTY_ID;
+        if (created) {
+            if (!create) return GROUP_MISSING;
+            uint32_t id = allocate_id();
+            if (id == EMPTY_ID) return GROUP_FULL;
+            slot(id).name = name;
+            shard.entries[index] = Entry{hash, id};
+            if (++shard.count * 2 > shard.entries.size()) {
+                grow(shard);
+                index = find(shard, hash, name);
+            }
+        }
+        uint32_t id = shard.entries[index].id;
+        Group& group = slot(id);
+        GroupResult result = f(id, group, created);
+        if (group.unused()) {
+            remove(shard, index);
+            group = Group();
+            lock_guard<mutex> ids(id_mutex);
+            free_ids.push_back(id);
+        }
+        return result;
+    }
+
+    // Name of a group the caller knows exists, such as one its client belongs to
+    const string& name_of(uint32_t id) const { return slot(id).name; }
+
+    // Call f(group) for every group, holding one shard's shared lock at a time
+    template <typename F>
+    void for_each(F&& f) const {
+        for (const Shard& shard : shards) {
+            auto lock = timed_lock<shared_lock<shared_mutex>>(shard.mutex, LOCK_GROUPS);
+            for (const Entry& entry : shard.entries) {
+                if (entry.id != EMPTY_ID) f(slot(entry.id));
+            }
+        }
+    }
+};
+
+// A token bucket: up to burst commands at once, refilled at rate per second. Rate 0 is unlimited.
+struct RateRule {
+    double rate = 0;
+    double burst = 0;
+};
+
+// Slot of the limit on all commands together, after the per-command limits
+#define RATE_ALL CMD_KINDS
+typedef array<RateRule, CMD_KINDS + 1> RateRules;
+
+// Rate limits read from the --limits file. Every line is "USER COMMAND RATE BURST", where
+// USER or COMMAND may be * for every user or every command; a user's own line for a command
+// replaces the * line. Replaced as a whole on reload, never modified in place.
+class RateLimits {
+    RateRules defaults;
+    unordered_map<string, RateRules> users;
+
+public:
+    static shared_ptr<RateLimits> load(const string& path) {
+        ifstream file(path);
+        if (!file) {
+            cerr << "Error: Cannot read rate limits " << path << endl;
+            return nullptr;
+        }
+        auto limits = make_shared<RateLimits>();
+        vector<tuple<string, int, RateRule>> overrides;
+        string line;
+        for (int number = 1; getline(file, line); ++number) {
+            line = line.substr(0, line.find('#'));
+            istringstream fields(line);
+            string user, command;
+            RateRule rule;
+            if (!(fields >> user)) continue;
+            int kind = -1;
+            if (fields >> command >> rule.rate >> rule.burst) {
+                kind = command == "*" ? RATE_ALL : lookup_command(command);
+            }
+            if (kind < 0 || kind == CMD_INVALID || kind == CMD_EXIT || rule.rate < 0 || rule.burst < 1) {
+                cerr << "Error: " << path << ":" << number << ": expected USER COMMAND RATE BURST" << endl;
+                return nullptr;
+            }
+            if (user == "*") {
+                limits->defaults[kind] = rule;
+            } else {
+                overrides.emplace_back(user, kind, rule);
+            }
+        }
+        for (const auto& [user, kind, rule] : overrides) {
+            auto it = limits->users.try_emplace(user, limits->defaults).first;
+            it->second[kind] = rule;
+        }
+        return limits;
+    }
+
+    const RateRules& rules(const string& username) const {
+        auto it = users.find(username);
+        return it == users.end() ? defaults : it->second;
+    }
+};
+
+atomic<shared_ptr<const RateLimits>> rate_limits;  // Unset unless --limits was given
+atomic<uint64_t> rate_limits_version{0};            // Bumped on every reload
+
+// Token buckets of one user. Sessions on different reactors share them, so they have a lock
+// of their own; it is only ever contended by the same user's other sessions.
+struct UserBuckets {
+    mutex bucket_mutex;
+    uint64_t version = ~0ull;       // rate_limits_version the rules were resolved at
+    RateRules rules;
+    double tokens[CMD_KINDS + 1];
+    int64_t refilled_ns[CMD_KINDS + 1];
+
+    // Take a token from the command's bucket and from the all-commands bucket, or from neither
+    bool take(const string& username, CommandKind kind) {
+        lock_guard<mutex> lock(bucket_mutex);
+        int64_t now = now_ns();
+        uint64_t current = rate_limits_version.load(memory_order_acquire);
+        if (version != current) {
+            // New rules start with full buckets
+            version = current;
+            rules = rate_limits.load()->rules(username);
+            for (int i = 0; i <= CMD_KINDS; ++i) {
+                tokens[i] = rules[i].burst;
+                refilled_ns[i] = now;
+            }
+        }
+        int slots[2] = {kind, RATE_ALL};
+        for (int slot : slots) {
+            const RateRule& rule = rules[slot];
+            if (rule.rate == 0) continue;
+            tokens[slot] = min(rule.burst, tokens[slot] + (now - refilled_ns[slot]) * rule.rate / 1e9);
+            refilled_ns[slot] = now;
+            if (tokens[slot] < 1) return false;
+        }
+        for (int slot : slots) {
+            if (rules[slot].rate != 0) tokens[slot] -= 1;
+        }
+        return true;
+    }
+};
+
+ShardedMap<int, shared_ptr<Client>> clients(LOCK_CLIENTS);  // Authenticated clients by socket
+atomic<shared_ptr<const Credentials>> users;  // Replaced as a whole, never modified in place
+ShardedMap<string, vector<shared_ptr<Client>>> sessions(LOCK_SESSIONS);  // Username → Logged-in connections
+GroupTable groups;          // Group Name → Members
+ShardedMap<string, vector<int>> remote_users(LOCK_SESSIONS);  // Username → Nodes it is logged in on (cluster mode)
+
+vector<unique_ptr<Reactor>> reactors;
+int server_port = PORT;
+string users_file = USERS_FILE;
+string credentials_file;    // Hashed credential index, used instead of users_file when set
+string limits_file;         // Rate limits, reloaded together with the credentials
+size_t max_sessions = DEFAULT_MAX_SESSIONS;    // Concurrent logins allowed per user
+size_t max_outq = DEFAULT_OUTQ;
+OverflowPolicy overflow_policy = OVERFLOW_BACKPRESSURE;
+int login_timeout = DEFAULT_LOGIN_TIMEOUT;
+int max_unauthenticated = DEFAULT_MAX_UNAUTHENTICATED;
+atomic<int> unauthenticated{0};   // Connections that have not logged in yet
+bool zerocopy_enabled = false;    // Send large payloads with MSG_ZEROCOPY
+bool uring_enabled = false;       // Reactors run on io_uring instead of epoll
+int presence_window = DEFAULT_PRESENCE_WINDOW;
+
+thread_local Reactor* current_reactor = nullptr;         // Reactor run by this thread
+thread_local shared_ptr<Client> current_client;          // Client whose input is being handled
+
+// Load the users file, or the credential index when one was given. On failure the
+// current credentials stay in place.
+bool load_users() {
+    shared_ptr<Credentials> table = credentials_file.empty() ? Credentials::load_text(users_file)
+                                                              : Credentials::load_index(credentials_file);
+    if (!table) return false;
+    users.store(std::move(table));
+    return true;
+}
+
+bool load_rate_limits() {
+    shared_ptr<RateLimits> limits = RateLimits::load(limits_file);
+    if (!limits) return false;
+    rate_limits.store(std::move(limits));
+    rate_limits_version.fetch_add(1, memory_order_release);
+    return true;
+}
+
+// Hand work to a reactor. The reactor thread itself picks up its pending lists after every
+// epoll batch, so the eventfd is only written when another thread posts.
+template <typename T>
+void post_to_reactor(Reactor& reactor, vector<T> Reactor::*list, T item) {
+    bool wake;
+    {
+        auto lock = timed_lock<unique_lock<mutex>>(reactor.pending_mutex, LOCK_PENDING);
+        (reactor.*list).push_back(std::move(item));
+        wake = !reactor.woken && current_reactor != &reactor;
+        if (wake) reactor.woken = true;
+    }
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = write(reactor.wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void schedule_flush_locked(Client& client) {
+    if (!client.flush_scheduled) {
+        client.flush_scheduled = true;
+        post_to_reactor(*client.reactor, &Reactor::pending_flush, client.shared_from_this());
+    }
+}
+
+// Backpressure: stop reading from the client that produced the message until this queue drains
+void pause_sender_locked(Client& client) {
+    const shared_ptr<Client>& sender = current_client;
+    if (!sender) return;
+    for (const auto& blocked : client.blocked_senders) {
+        if (blocked == sender) return;
+    }
+    client.blocked_senders.push_back(sender);
+    sender->pause_count++;
+    bump(metrics().sender_pauses);
+}
+
+void resume_sender(const shared_ptr<Client>& sender) {
+    if (--sender->pause_count == 0) {
+        post_to_reactor(*sender->reactor, &Reactor::pending_resume, sender);
+    }
+}
+
+// Queue a message for a client. Never blocks on the socket; the owning reactor writes it.
+ssize_t send_all(Client& client, const Payload& payload) {
+    auto lock = timed_lock<unique_lock<mutex>>(client.out_mutex, LOCK_OUTQ);
+    if (client.closed || client.overflowed) {
+        return -1;
+    }
+    if (client.out_count >= max_outq) {
+        if (overflow_policy == OVERFLOW_DROP) {
+            bump(metrics().dropped);
+            return -1;
+        }
+        if (overflow_policy == OVERFLOW_DISCONNECT || client.out_count >= max_outq * OUTQ_HARD_LIMIT_FACTOR) {
+            bump(metrics().overflow_disconnects);
+            client.overflowed = true;
+            schedule_flush_locked(client);
+            return -1;
+        }
+        pause_sender_locked(client);
+    }
+
+    if (client.out_count == client.outq.size()) {
+        // Grow the ring, keeping the queued messages in order
+        OutQueue grown(max((size_t)4, client.outq.size() * 2));
+        for (size_t i = 0; i < client.out_count; ++i) {
+            grown[i] = std::move(client.outq[(client.out_head + i) & (client.outq.size() - 1)]);
+        }
+        client.outq.swap(grown);
+        client.out_head = 0;
+    }
+    client.outq[(client.out_head + client.out_count) & (client.outq.size() - 1)] = payload;
+    client.out_count++;
+    metrics().queue_depth.observe(client.out_count);
+    schedule_flush_locked(client);
+    return payload.size();
+}
+
+ssize_t send_all(Client& client, const char* buffer, size_t length) {
+    if(length > MAX_MSG_SIZE){
+        buffer = "Error: Message too long.";
+        length = strlen(buffer);
+    }
+    return send_all(client, Payload({string_view(buffer, length)}));
+}
+
+// Send to an authenticated client by socket
+ssize_t send_all(int socket, const Payload& payload) {
+    ssize_t result = -1;
+    clients.read(socket, [&](const shared_ptr<Client>& client) { result = send_all(*client, payload); });
+    return result;
+}
+
+// Message log record types. A record is a LOG_HEADER_SIZE header (body length and checksum)
+// followed by the type, a length-prefixed key and the value:
+//   LOG_PRIVATE  recipient  formatted message
+//   LOG_GROUP    group      formatted message
+//   LOG_JOIN     group      username          (durable group membership)
+//   LOG_LEAVE    group      username
+//   LOG_CURSOR   username   offset up to which the user has received everything
+enum LogRecordType : uint8_t { LOG_PRIVATE = 1, LOG_GROUP, LOG_JOIN, LOG_LEAVE, LOG_CURSOR };
+
+uint32_t log_checksum(const char* data, size_t length) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Append-only message log in fixed-size, memory-mapped segment files named by the offset of
+// their first byte. Offsets are global byte positions and never reused; a record never spans
+// two segments. A sender reserves an offset with one atomic operation and queues the record
+// in its own thread's staging buffer, so the live fan-out neither waits for the disk nor
+// shares a lock with other senders. A writer thread collects the buffers, copies each batch
+// into the segments and syncs it with one msync per segment (group commit), indexes it, then
+// streams backlogs to users who logged in.
+class MessageLog {
+    struct Record {
+        uint64_t offset;
+        LogRecordType type;
+        string key;
+        string value;
+    };
+    struct Segment {
+        int fd = -1;
+        char* data = nullptr;
+        size_t dirty_begin = LOG_SEGMENT_SIZE;
+        size_t dirty_end = 0;
+    };
+    struct UserIndex {
+        uint64_t cursor = 0;            // Everything below was delivered
+        unordered_set<string> groups;   // Durable group memberships
+        vector<uint64_t> inbox;         // Private messages at or above the cursor
+    };
+    struct Replay {
+        shared_ptr<Client> client;
+        uint64_t private_end;           // Private messages below this offset are in the backlog
+        vector<pair<string, uint64_t>> group_ends;  // So are group messages below each end
+        vector<uint64_t> offsets;       // Backlog records, in log order
+        size_t next = 0;
+        uint64_t cursor;                // Cursor to record once the backlog is delivered
+        bool announced = false;
+    };
+
+    // Records queued by one thread. Only the writer, taking the batch, competes for the lock.
+    struct Staging {
+        mutex lock;
+        vector<Record> records;
+    };
+
+    string dir;
+    atomic<uint64_t> next_offset{0};
+    mutex staging_mutex;                // Guards the list of buffers
+    vector<unique_ptr<Staging>> stagings;
+    atomic<bool> staged{true};          // Set when a record is queued; starts set for a first pass
+    mutex wake_mutex;                   // Guards pending_replays
+    condition_variable wake;
+    vector<Replay> pending_replays;
+    mutex index_mutex;                  // Guards the index
+    unordered_map<string, UserIndex> user_index;
+    unordered_map<string, vector<uint64_t>> group_index;   // Group → message offsets
+
+    map<uint64_t, Segment> segments;    // By base offset (writer thread, or startup)
+    vector<Replay> replays;             // Backlogs being delivered (writer thread)
+    uint64_t retired_below = 0;         // Segments below were deleted
+    uint64_t retention_base = 0;        // Tail segment when retention last ran
+    uint64_t retire_below = 0;          // Segments to delete once the checkpoint is on disk
+    uint64_t checkpoint_end = 0;        // End of that checkpoint; 0 if none is outstanding
+
+    static uint64_t segment_base(uint64_t offset) { return offset - offset % LOG_SEGMENT_SIZE; }
+
+    string segment_path(uint64_t base) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu.log", (unsigned long long)base);
+        return dir + name;
+    }
+
+    Segment& segment(uint64_t base) {
+        auto it = segments.find(base);
+        if (it != segments.end()) return it->second;
+        string path = segment_path(base);
+        Segment segment;
+        segment.fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (segment.fd < 0 || ftruncate(segment.fd, LOG_SEGMENT_SIZE) < 0) {
+            cerr << "Error: Cannot open message log segment " << path << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+        void* data = mmap(nullptr, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+        if (data == MAP_FAILED) {
+            cerr << "Error: Cannot map message log segment " << path << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+        segment.data = static_cast<char*>(data);
+        return segments.emplace(base, segment).first->second;
+    }
+
+    void index_locked(uint64_t offset, LogRecordType type, const string& key, const string& value) {
+        switch (type) {
+        case LOG_PRIVATE: {
+            UserIndex& user = user_index[key];
+            if (offset >= user.cursor) user.inbox.push_back(offset);  // Else a cursor came first
+            break;
+        }
+        case LOG_GROUP:
+            group_index[key].push_back(offset);
+            break;
+        case LOG_JOIN:
+            user_index[value].groups.insert(key);
+            break;
+        case LOG_LEAVE:
+            user_index[value].groups.erase(key);
+            break;
+        case LOG_CURSOR: {
+            UserIndex& user = user_index[key];
+            uint64_t cursor = strtoull(value.c_str(), nullptr, 10);
+            if (cursor > user.cursor) {
+                user.cursor = cursor;
+                user.inbox.erase(user.inbox.begin(), lower_bound(user.inbox.begin(), user.inbox.end(), cursor));
+            }
+            break;
+        }
+        }
+    }
+
+    // The calling thread's staging buffer, registered on first use
+    Staging& local_staging() {
+        static thread_local Staging* local = nullptr;
+        if (!local) {
+            auto lock = timed_lock<unique_lock<mutex>>(staging_mutex, LOCK_LOG);
+            stagings.push_back(make_unique<Staging>());
+            local = stagings.back().get();
+        }
+        return *local;
+    }
+
+    // Reserve an offset and queue the record. The offset is reserved under the buffer's lock,
+    // so once the writer has read next_offset, every record below it is in a buffer by the
+    // time the writer takes that buffer's lock.
+    uint64_t stage(LogRecordType type, string key, string value) {
+        size_t size = LOG_HEADER_SIZE + 5 + key.size() + value.size();
+        Staging& local = local_staging();
+        uint64_t offset;
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(local.lock, LOCK_LOG);
+            uint64_t end = next_offset.load();
+            do {
+                offset = end;
+                if (offset % LOG_SEGMENT_SIZE + size > LOG_SEGMENT_SIZE) {
+                    offset = segment_base(offset) + LOG_SEGMENT_SIZE;
+                }
+            } while (!next_offset.compare_exchange_weak(end, offset + size));
+            local.records.push_back(Record{offset, type, std::move(key), std::move(value)});
+        }
+        if (!staged.exchange(true)) {
+            lock_guard<mutex> lock(wake_mutex);
+            wake.notify_one();
+        }
+        return offset;
+    }
+
+    // Pick a backlog once every record below its ends is indexed
+    void select_locked(Replay& replay) {
+        UserIndex& user = user_index[replay.client->username];
+        auto select = [&](const vector<uint64_t>& offsets, uint64_t end) {
+            auto first = lower_bound(offsets.begin(), offsets.end(), user.cursor);
+            replay.offsets.insert(replay.offsets.end(), first, lower_bound(first, offsets.end(), end));
+            replay.cursor = min(replay.cursor, end);
+        };
+        select(user.inbox, replay.private_end);
+        for (const auto& group : replay.group_ends) {
+            auto it = group_index.find(group.first);
+            if (it != group_index.end()) select(it->second, group.second);
+        }
+        sort(replay.offsets.begin(), replay.offsets.end());
+    }
+
+    // Offset below which nothing is needed: a user's cursor while they belong to groups, else
+    // their oldest undelivered private message, and the next record of every open backlog
+    uint64_t retention_bound_locked(uint64_t written) const {
+        uint64_t keep = written;
+        for (const auto& user : user_index) {
+            const UserIndex& index = user.second;
+            if (!index.groups.empty()) {
+                keep = min(keep, index.cursor);
+            } else if (!index.inbox.empty()) {
+                keep = min(keep, index.inbox.front());
+            }
+        }
+        for (const Replay& replay : replays) {
+            if (replay.next < replay.offsets.size()) keep = min(keep, replay.offsets[replay.next]);
+        }
+        return keep;
+    }
+
+    // Each time the tail enters a new segment, drop the group offsets below the bound and plan
+    // to delete the segments below it. Those segments may hold the only record of a membership
+    // or cursor, so all of them are written again at the tail first.
+    void plan_retention_locked(uint64_t written) {
+        if (checkpoint_end || segment_base(written) == retention_base) return;
+        retention_base = segment_base(written);
+        uint64_t keep = segment_base(retention_bound_locked(written));
+        if (keep <= retired_below) return;
+        for (auto it = group_index.begin(); it != group_index.end();) {
+            vector<uint64_t>& offsets = it->second;
+            offsets.erase(offsets.begin(), lower_bound(offsets.begin(), offsets.end(), keep));
+            it = offsets.empty() ? group_index.erase(it) : next(it);
+        }
+        for (const auto& user : user_index) {
+            for (const string& group : user.second.groups) {
+                stage(LOG_JOIN, group, user.first);
+            }
+            if (user.second.cursor > 0) {
+                stage(LOG_CURSOR, user.first, to_string(user.second.cursor));
+            }
+        }
+        retire_below = keep;
+        checkpoint_end = next_offset;
+    }
+
+    // Unmap, close and delete the segments below retire_below
+    void retire() {
+        for (auto it = segments.begin(); it != segments.end() && it->first < retire_below;) {
+            munmap(it->second.data, LOG_SEGMENT_SIZE);
+            close(it->second.fd);
+            it = segments.erase(it);
+        }
+        for (uint64_t base = retired_below; base < retire_below; base += LOG_SEGMENT_SIZE) {
+            if (unlink(segment_path(base).c_str()) == 0) {
+                bump(metrics().log_retired);
+            } else if (errno != ENOENT) {
+                cerr << "Error: Cannot delete message log segment: " << strerror(errno) << endl;
+            }
+        }
+        retired_below = retire_below;
+        checkpoint_end = 0;
+    }
+
+    // Decode the record at offset; false if there is none, it is torn or it was retired
+    bool read(uint64_t offset, LogRecordType& type, string_view& key, string_view& value) {
+        if (offset < retired_below) return false;
+        const char* record = segment(segment_base(offset)).data + offset % LOG_SEGMENT_SIZE;
+        size_t room = LOG_SEGMENT_SIZE - offset % LOG_SEGMENT_SIZE;
+        uint32_t length, checksum, key_length;
+        if (room < LOG_HEADER_SIZE) return false;
+        memcpy(&length, record, 4);
+        memcpy(&checksum, record + 4, 4);
+        if (length < 5 || length > room - LOG_HEADER_SIZE) return false;
+        const char* body = record + LOG_HEADER_SIZE;
+        if (log_checksum(body, length) != checksum) return false;
+        memcpy(&key_length, body + 1, 4);
+        if (key_length > length - 5) return false;
+        type = (LogRecordType)body[0];
+        key = string_view(body + 5, key_length);
+        value = string_view(body + 5 + key_length, length - 5 - key_length);
+        return true;
+    }
+
+    void write(const Record& record) {
+        Segment& target = segment(segment_base(record.offset));
+        size_t position = record.offset % LOG_SEGMENT_SIZE;
+        uint32_t length = 5 + record.key.size() + record.value.size();
+        uint32_t key_length = record.key.size();
+        char* body = target.data + position + LOG_HEADER_SIZE;
+        body[0] = (char)record.type;
+        memcpy(body + 1, &key_length, 4);
+        memcpy(body + 5, record.key.data(), record.key.size());
+        memcpy(body + 5 + record.key.size(), record.value.data(), record.value.size());
+        uint32_t checksum = log_checksum(body, length);
+        memcpy(target.data + position + 4, &checksum, 4);
+        memcpy(target.data + position, &length, 4);
+        target.dirty_begin = min(target.dirty_begin, position);
+        target.dirty_end = max(target.dirty_end, position + LOG_HEADER_SIZE + length);
+        Metrics& stats = metrics();
+        bump(stats.log_records);
+        bump(stats.log_bytes, LOG_HEADER_SIZE + length);
+    }
+
+    // Group commit: one msync per segment covers every record of the batch
+    void sync() {
+        static const size_t page = sysconf(_SC_PAGESIZE);
+        for (auto& entry : segments) {
+            Segment& target = entry.second;
+            if (target.dirty_begin >= target.dirty_end) continue;
+            size_t begin = target.dirty_begin - target.dirty_begin % page;
+            int64_t start = now_ns();
+            if (msync(target.data + begin, target.dirty_end - begin, MS_SYNC) < 0) {
+                cerr << "Error: Message log sync failed: " << strerror(errno) << endl;
+            }
+            metrics().log_sync_ns.observe(now_ns() - start);
+            bump(metrics().log_syncs);
+            target.dirty_begin = LOG_SEGMENT_SIZE;
+            target.dirty_end = 0;
+        }
+    }
+
+    static size_t queued(Client& client) {
+        auto lock = timed_lock<unique_lock<mutex>>(client.out_mutex, LOCK_OUTQ);
+        return client.closed ? SIZE_MAX : client.out_count;
+    }
+
+    // Send as much of a backlog as the client's queue has room for. Returns true when done.
+    bool deliver(Replay& replay) {
+        Client& client = *replay.client;
+        if (!replay.announced) {
+            size_t count = replay.offsets.size();
+            string notice = "Delivering " + to_string(count) + (count == 1 ? " message" : " messages") +
+                            " received while you were away.";
+            send_all(client, notice.c_str(), notice.size());
+            replay.announced = true;
+        }
+        while (replay.next < replay.offsets.size()) {
+            size_t depth = queued(client);
+            if (depth == SIZE_MAX) return true;    // Gone; its cursor stays where it was
+            if (depth >= max_outq / 2 + 1) return false;
+            LogRecordType type;
+            string_view key, value;
+            if (read(replay.offsets[replay.next++], type, key, value)) {
+                if (send_all(client, Payload({value})) < 0) return true;
+                bump(metrics().log_replayed);
+            }
+        }
+        client.replaying = false;
+        append(LOG_CURSOR, client.username, to_string(replay.cursor));
+        return true;
+    }
+
+public:
+    explicit MessageLog(const string& dir) : dir(dir) {}
+
+    // Map the existing segments and rebuild the index. Scanning stops at the first empty or
+    // torn record of each segment; appends continue after the last good one.
+    bool recover() {
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            cerr << "Error: Cannot create message log directory " << dir << ": " << strerror(errno) << endl;
+            return false;
+        }
+        DIR* listing = opendir(dir.c_str());
+        if (!listing) {
+            cerr << "Error: Cannot open message log directory " << dir << ": " << strerror(errno) << endl;
+            return false;
+        }
+        vector<uint64_t> bases;
+        while (dirent* entry = readdir(listing)) {
+            string name = entry->d_name;
+            if (name.size() == 24 && name.compare(20, 4, ".log") == 0) {
+                bases.push_back(strtoull(name.c_str(), nullptr, 10));
+            }
+        }
+        closedir(listing);
+        sort(bases.begin(), bases.end());
+        if (!bases.empty()) retired_below = bases.front();
+
+        for (uint64_t base : bases) {
+            uint64_t offset = base;
+            LogRecordType type;
+            string_view key, value;
+            while (read(offset, type, key, value)) {
+                index_locked(offset, type, string(key), string(value));
+                offset += LOG_HEADER_SIZE + 5 + key.size() + value.size();
+            }
+            next_offset = offset;
+        }
+        if (!bases.empty()) {
+            // Clear a torn tail so that it cannot be mistaken for records later
+            size_t position = next_offset % LOG_SEGMENT_SIZE;
+            Segment& last = segment(segment_base(next_offset));
+            memset(last.data + position, 0, min<size_t>(LOG_SEGMENT_SIZE - position, 1024 * 1024 + 64));
+        }
+        return true;
+    }
+
+    // Queue a record and return its offset. Never touches the disk. Messages are indexed by
+    // the writer; memberships and cursors right away, so that the next login sees them.
+    uint64_t append(LogRecordType type, string key, string value) {
+        if (type == LOG_PRIVATE || type == LOG_GROUP) {
+            return stage(type, std::move(key), std::move(value));
+        }
+        auto lock = timed_lock<unique_lock<mutex>>(index_mutex, LOCK_LOG);
+        uint64_t offset = stage(type, key, value);
+        index_locked(offset, type, key, value);
+        return offset;
+    }
+
+    // Offset of the next record. Read under the lock that orders an append against a change
+    // of membership, it splits the log into what was delivered live and what was not.
+    uint64_t tail() {
+        return next_offset.load();
+    }
+
+    vector<string> user_groups(const string& username) {
+        auto lock = timed_lock<unique_lock<mutex>>(index_mutex, LOCK_LOG);
+        auto it = user_index.find(username);
+        if (it == user_index.end()) return {};
+        return vector<string>(it->second.groups.begin(), it->second.groups.end());
+    }
+
+    // Durable group memberships, to recreate the groups at startup
+    unordered_map<string, unordered_set<string>> memberships() {
+        auto lock = timed_lock<unique_lock<mutex>>(index_mutex, LOCK_LOG);
+        unordered_map<string, unordered_set<string>> members;
+        for (const auto& user : user_index) {
+            for (const string& group : user.second.groups) {
+                members[group].insert(user.first);
+            }
+        }
+        return members;
+    }
+
+    // Stream the user's backlog: private messages from the cursor up to private_end and the
+    // messages of each group from the cursor up to the offset where the user rejoined it.
+    // The writer picks the records once it has indexed everything below those ends.
+    void request_replay(const shared_ptr<Client>& client, uint64_t private_end,
+                        const vector<pair<string, uint64_t>>& group_ends) {
+        client->replaying = true;
+        lock_guard<mutex> lock(wake_mutex);
+        pending_replays.push_back(Replay{client, private_end, group_ends, {}, 0, private_end, false});
+        wake.notify_one();
+    }
+
+    // Writer thread
+    void run() {
+        vector<Record> batch;
+        vector<Record> later;           // Reserved at or above the watermark; next round
+        vector<Replay> requested;
+        while (true) {
+            {
+                unique_lock<mutex> lock(wake_mutex);
+                auto ready = [&] { return staged.load() || !pending_replays.empty(); };
+                if (replays.empty()) {
+                    wake.wait(lock, ready);
+                } else {
+                    wake.wait_for(lock, chrono::milliseconds(LOG_REPLAY_WAIT_MS), ready);
+                }
+                requested.swap(pending_replays);
+            }
+            // Every record below the watermark is in a buffer by now, and every requested
+            // backlog ends below it
+            staged.exchange(false);
+            uint64_t written = next_offset.load();
+            batch.swap(later);
+            {
+                auto lock = timed_lock<unique_lock<mutex>>(staging_mutex, LOCK_LOG);
+                for (auto& buffer : stagings) {
+                    auto buffer_lock = timed_lock<unique_lock<mutex>>(buffer->lock, LOCK_LOG);
+                    move(buffer->records.begin(), buffer->records.end(), back_inserter(batch));
+                    buffer->records.clear();
+                }
+            }
+            sort(batch.begin(), batch.end(), [](const Record& a, const Record& b) { return a.offset < b.offset; });
+            auto split = partition_point(batch.begin(), batch.end(),
+                                         [&](const Record& record) { return record.offset < written; });
+            move(split, batch.end(), back_inserter(later));
+            batch.erase(split, batch.end());
+            for (const Record& record : batch) {
+                write(record);
+            }
+            sync();
+            {
+                auto lock = timed_lock<unique_lock<mutex>>(index_mutex, LOCK_LOG);
+                for (const Record& record : batch) {
+                    if (record.type == LOG_PRIVATE || record.type == LOG_GROUP) {
+                        index_locked(record.offset, record.type, record.key, record.value);
+                    }
+                }
+                for (Replay& replay : requested) {
+                    select_locked(replay);
+                    if (replay.offsets.empty()) {
+                        replay.client->replaying = false;
+                    } else {
+                        replays.push_back(std::move(replay));
+                    }
+                }
+                plan_retention_locked(written);
+            }
+            batch.clear();
+            requested.clear();
+            if (checkpoint_end && written >= checkpoint_end) {
+                retire();
+            }
+            for (size_t i = 0; i < replays.size();) {
+                if (deliver(replays[i])) {
+                    replays.erase(replays.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+        }
+    }
+};
+
+unique_ptr<MessageLog> message_log;     // Set with --log-dir
+
+// Describe up to WRITE_BATCH queued messages, starting at the unwritten part of the head,
+// as one iovec array of at most limit bytes; the last message may be cut short. Returns the
+// number of entries and their total length in bytes.
+size_t gather_queue_locked(const Client& client, iovec* iov, size_t& bytes, size_t limit) {
+    size_t mask = client.outq.size() - 1;
+    size_t count = 0;
+    bytes = 0;
+    for (; count < client.out_count && count < WRITE_BATCH && bytes < limit; ++count) {
+        const Payload& payload = client.outq[(client.out_head + count) & mask];
+        // Framed clients get the prebuilt header in front of the text; text clients skip it
+        bool framed = client.framed && count >= client.unframed;
+        size_t header_size = framed ? FRAME_HEADER_SIZE : 0;
+        const char* data = framed ? payload.frame() : payload.data();
+        size_t skip = count == 0 ? client.out_offset : 0;
+        iov[count].iov_base = (void*)(data + skip);
+        iov[count].iov_len = min(header_size + payload.size() - skip, limit - bytes);
+        bytes += iov[count].iov_len;
+    }
+    return count;
+}
+
+// Retire every message a write completed and remember how far into the next one it got
+void retire_written_locked(Client& client, size_t bytes_sent) {
+    size_t mask = client.outq.size() - 1;
+    Metrics& stats = metrics();
+    bump(stats.bytes_written, bytes_sent);
+    while (bytes_sent > 0) {
+        size_t header_size = client.framed && client.unframed == 0 ? FRAME_HEADER_SIZE : 0;
+        size_t remaining = header_size + client.outq[client.out_head].size() - client.out_offset;
+        if (bytes_sent < remaining) {
+            client.out_offset += bytes_sent;
+            break;
+        }
+        bytes_sent -= remaining;
+        client.outq[client.out_head].reset();
+        client.out_head = (client.out_head + 1) & mask;
+        client.out_count--;
+        client.out_offset = 0;
+        if (client.unframed > 0) client.unframed--;
+        bump(stats.messages_written);
+    }
+    if (client.out_count == 0 && client.outq.size() > 64) {
+        OutQueue().swap(client.outq);  // Give back the memory of a burst
+        client.out_head = 0;
+    }
+}
+
+// Write queued messages until the queue is empty, the socket is full or FLUSH_QUANTUM bytes
+// went out, coalescing up to WRITE_BATCH messages into one sendmsg. Runs on the owning
+// reactor. Returns 1 when drained, 0 when the socket is full (EPOLLOUT resumes), 2 when the
+// quantum is used up and -1 on error.
+int write_queue_locked(Client& client) {
+    size_t budget = FLUSH_QUANTUM;
+    while (client.out_count > 0) {
+        if (budget == 0) return 2;
+        size_t mask = client.outq.size() - 1;
+        iovec iov[WRITE_BATCH];
+        size_t bytes;
+        size_t count = gather_queue_locked(client, iov, bytes, budget);
+
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        bool zerocopy = client.zerocopy && bytes >= ZEROCOPY_MIN_SIZE;
+        // MSG_MORE lets the kernel fill full segments when the next call follows immediately.
+        // MSG_DONTWAIT because io_uring connections are left in blocking mode.
+        bool more = count < client.out_count && bytes < budget;
+        int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0) | (zerocopy ? MSG_ZEROCOPY : 0);
+        ssize_t bytes_sent = sendmsg(client.socket, &msg, flags);
+        bump(metrics().write_calls);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;  // Retry if interrupted
+            }
+            if (errno == ENOBUFS && zerocopy) {
+                client.zerocopy = false;  // Out of pinned-page budget; fall back to copying
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (zerocopy) {
+            // The kernel reads the pages until it reports this call complete on the error queue
+            for (size_t i = 0; i < count; ++i) {
+                client.zc_inflight.emplace_back(client.zc_next, client.outq[(client.out_head + i) & mask]);
+            }
+            client.zc_next++;
+        }
+        retire_written_locked(client, bytes_sent);
+        budget -= bytes_sent;
+        if ((size_t)bytes_sent < bytes) {
+            return 0;  // Short write: the send buffer is full, EPOLLOUT resumes
+        }
+    }
+    return 1;
+}
+
+// Cluster mode: every node serves its own clients and tells its peers which users are online
+// and which groups they are in. A message for users on other nodes is forwarded once per node,
+// and that node fans it out to its own clients.
+//
+// Each node opens one link to every peer and only ever writes to it, so a node reads only the
+// links its peers opened. A link starts with a hello each way and a snapshot of the sender's
+// presence and memberships; frames are laid out like message log records: a 4-byte big-endian
+// length, the type, a key with a 4-byte length, and the value.
+//   CLUSTER_HELLO      -          node ID
+//   CLUSTER_USER_ON    username   -                   (first session on the sending node)
+//   CLUSTER_USER_OFF   username   -
+//   CLUSTER_JOIN       group      username            (a session on the sending node joined)
+//   CLUSTER_LEAVE      group      username            (no session of the user is left in it)
+//   CLUSTER_PRIVATE    recipient  formatted message
+//   CLUSTER_GROUP      group      formatted message   (for the receiver's members of the group)
+//   CLUSTER_BROADCAST  -          formatted message   (for all of the receiver's clients)
+//   CLUSTER_PRESENCE   group      formatted notice    (for clients that want presence notices:
+//                                                      all of them, or the group's members)
+// Presence and membership frames set state rather than count it, so a frame that overlaps
+// the snapshot does no harm.
+enum ClusterFrameType : uint8_t { CLUSTER_HELLO = 1, CLUSTER_USER_ON, CLUSTER_USER_OFF, CLUSTER_JOIN, CLUSTER_LEAVE,
+                                  CLUSTER_PRIVATE, CLUSTER_GROUP, CLUSTER_BROADCAST, CLUSTER_PRESENCE };
+
+// Outbound link to one peer, written by its own thread. Frames queued while the link is down
+// are dropped; the snapshot sent when it comes back covers them.
+struct Peer {
+    string host;
+    string port;
+    atomic<int> node{-1};       // Learned from the peer's hello
+    mutex out_mutex;            // Guards everything below
+    condition_variable ready;
+    bool connected = false;
+    bool overflowed = false;    // outbuf reached CLUSTER_QUEUE_LIMIT; the link is reset
+    string outbuf;              // Frames not yet written, sent with one write per wakeup
+};
+
+int node_id = -1;               // This node's ID in cluster mode
+vector<unique_ptr<Peer>> peers;
+atomic<int> peers_connected{0};
+
+void append_cluster_frame(string& out, ClusterFrameType type, string_view key, string_view value) {
+    size_t start = out.size();
+    out.resize(start + FRAME_HEADER_SIZE + 5);
+    encode_frame_header(&out[start], 5 + key.size() + value.size());
+    out[start + FRAME_HEADER_SIZE] = (char)type;
+    encode_frame_header(&out[start + FRAME_HEADER_SIZE + 1], key.size());
+    out.append(key);
+    out.append(value);
+}
+
+void queue_to_peer(Peer& peer, const string& frame) {
+    auto lock = timed_lock<unique_lock<mutex>>(peer.out_mutex, LOCK_CLUSTER);
+    if (!peer.connected || peer.overflowed) return;
+    if (peer.outbuf.size() + frame.size() > CLUSTER_QUEUE_LIMIT) {
+        peer.overflowed = true;
+    } else {
+        peer.outbuf += frame;
+        bump(metrics().cluster_frames_sent);
+    }
+    peer.ready.notify_one();
+}
+
+// Send a frame to every peer, or only to the given node
+void cluster_send(ClusterFrameType type, string_view key, string_view value, int node = -1) {
+    if (peers.empty()) return;
+    string frame;
+    append_cluster_frame(frame, type, key, value);
+    for (const auto& peer : peers) {
+        if (node < 0 || peer->node == node) queue_to_peer(*peer, frame);
+    }
+}
+
+// Forward a group message to the other nodes with members in the group
+void forward_to_group(const Group& group, const Payload& payload) {
+    for (const auto& node : group.remote) {
+        cluster_send(CLUSTER_GROUP, group.name, string_view(payload.data(), payload.size()), node.first);
+    }
+}
+
+// Whether another local session of the client's user is still in the group, in which case
+// the user remains a member as far as the other nodes are concerned
+bool other_session_in_group(const Client& client, const Group& group) {
+    if (max_sessions == 1) return false;
+    bool found = false;
+    sessions.read(client.username, [&](const vector<shared_ptr<Client>>& connections) {
+        for (const auto& connection : connections) {
+            if (connection.get() != &client && group.sockets.contains(connection->socket)) found = true;
+        }
+    });
+    return found;
+}
+
+void remove_client_from_groups(Client& client) {
+    for (uint32_t group_id : client.groups) {
+        // A copy, since the group is deleted (and the slot reused) once it is empty
+        string group_name = groups.name_of(group_id);
+        groups.modify(group_name, false, [&](uint32_t, Group& group, bool) {
+            group.sockets.erase(client.socket);  // Remove client from the group
+            if (!other_session_in_group(client, group)) {
+                cluster_send(CLUSTER_LEAVE, group_name, client.username);
+            }
+            return GROUP_OK;
+        });
+    }
+    client.groups.clear();
+}
+
+
+// Send to every local client, and unless the message came from a peer to every other node
+void broadcast_message(const Payload& payload, int exclude_socket = -1, bool forward = true) {
+    if (forward) {
+        cluster_send(CLUSTER_BROADCAST, {}, string_view(payload.data(), payload.size()));
+    }
+    uint64_t recipients = 0;
+    clients.for_each([&](int socket, const shared_ptr<Client>& client) {
+        if (socket != exclude_socket) {
+            send_all(*client, payload);
+            recipients++;
+        }
+    });
+    metrics().fanout.observe(recipients);
+}
+
+// Presence notices: a user joined or left the chat or a group. Clients can turn them off with
+// /presence off. With --presence-window they are collected for that long and every recipient
+// gets one digest per window (one for the chat, and one for each of their groups with changes)
+// instead of one message per event, so a reconnect storm of N users costs O(N) sends, not O(N²).
+
+// Presence notices collected over one window. A join and a leave of the same user cancel
+// out, so a user who reconnects within the window is not reported at all.
+struct PresenceBatch {
+    map<string, int> chat;                      // Username → joins minus leaves
+    map<string, map<string, int>> groups;       // Group → Username → joins minus leaves
+};
+
+mutex presence_mutex;
+PresenceBatch presence_batch;
+
+void send_presence(int socket, const Payload& payload, string_view exclude_user) {
+    clients.read(socket, [&](const shared_ptr<Client>& client) {
+        if (client->presence.load(memory_order_relaxed) && client->username != exclude_user) {
+            send_all(*client, payload);
+        }
+    });
+}
+
+// Send a notice to the local clients that want them; to the group's members if one is given
+void deliver_presence(const Group* group, const Payload& payload, string_view exclude_user = {}) {
+    uint64_t recipients = 0;
+    if (group) {
+        group->sockets.for_each([&](int member) { send_presence(member, payload, exclude_user); });
+        recipients = group->sockets.size();
+    } else {
+        clients.for_each([&](int, const shared_ptr<Client>& client) {
+            if (client->presence.load(memory_order_relaxed) && client->username != exclude_user) {
+                send_all(*client, payload);
+                recipients++;
+            }
+        });
+    }
+    metrics().fanout.observe(recipients);
+}
+
+// A user joined (or left) the chat, or the group when one is given. The group is locked by
+// the caller. Sent at once, or queued for the next digest.
+void announce_presence(const string& username, const Group* group, bool joined) {
+    if (presence_window > 0) {
+        auto lock = timed_lock<unique_lock<mutex>>(presence_mutex, LOCK_PRESENCE);
+        int& change = group ? presence_batch.groups[group->name][username] : presence_batch.chat[username];
+        change += joined ? 1 : -1;
+        return;
+    }
+    string place = group ? "the group " + group->name : "the chat";
+    Payload msg({username, joined ? " has joined " : " has left ", place, "."});
+    if (group) {
+        for (const auto& node : group->remote) {
+            cluster_send(CLUSTER_PRESENCE, group->name, string_view(msg.data(), msg.size()), node.first);
+        }
+    } else {
+        cluster_send(CLUSTER_PRESENCE, {}, string_view(msg.data(), msg.size()));
+    }
+    deliver_presence(group, msg, username);
+}
+
+// One notice for a window's changes, or "" if they cancelled out. A single change reads
+// like the notice sent without a window, and like it is not sent to the user it is about.
+string presence_digest(const map<string, int>& changes, const string& place, string& subject) {
+    string joined, left;
+    int count = 0;
+    for (const auto& [username, change] : changes) {
+        if (change == 0) continue;
+        string& list = change > 0 ? joined : left;
+        list += list.empty() ? username : ", " + username;
+        subject = username;
+        count++;
+    }
+    if (count == 0) return "";
+    if (count == 1) return subject + (joined.empty() ? " has left " : " has joined ") + place + ".";
+    subject.clear();
+    string digest;
+    if (!joined.empty()) digest = "Joined " + place + ": " + joined + ".";
+    if (!left.empty()) digest += (digest.empty() ? "Left " : " Left ") + place + ": " + left + ".";
+    return digest;
+}
+
+// Send the digests of the notices collected over each window
+void flush_presence() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(presence_window));
+        PresenceBatch batch;
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(presence_mutex, LOCK_PRESENCE);
+            swap(batch, presence_batch);
+        }
+        string subject;
+        string digest = presence_digest(batch.chat, "the chat", subject);
+        if (!digest.empty()) {
+            Payload msg({digest});
+            cluster_send(CLUSTER_PRESENCE, {}, digest);
+            deliver_presence(nullptr, msg, subject);
+        }
+        for (const auto& [group_name, changes] : batch.groups) {
+            digest = presence_digest(changes, "the group " + group_name, subject);
+            if (digest.empty()) continue;
+            Payload msg({digest});
+            groups.read(group_name, [&](const Group& group) {
+                for (const auto& node : group.remote) {
+                    cluster_send(CLUSTER_PRESENCE, group_name, digest, node.first);
+                }
+                deliver_presence(&group, msg, subject);
+            });
+        }
+    }
+}
+
+// Deliver to every session of the recipient, found through the username index. With the
+// message log, messages to a registered user who is offline are kept for their next login.
+void send_private_message(Client& sender, string_view recipient, string_view message) {
+    Payload msg({"[", sender.username, "]: ", message});
+    auto deliver = [&](const vector<shared_ptr<Client>>& connections) {
+        if (message_log) {
+            message_log->append(LOG_PRIVATE, string(recipient), string(msg.data(), msg.size()));
+        }
+        for (const auto& connection : connections) {
+            send_all(*connection, msg);
+        }
+        metrics().fanout.observe(connections.size());
+    };
+    bool found = sessions.read(recipient, deliver);
+    if (!peers.empty()) {
+        // Sessions on other nodes get one forwarded copy per node
+        found |= remote_users.read(recipient, [&](const vector<int>& nodes) {
+            for (int node : nodes) {
+                cluster_send(CLUSTER_PRIVATE, recipient, string_view(msg.data(), msg.size()), node);
+            }
+        });
+    }
+    if (!found && message_log && users.load()->contains(recipient)) {
+        // Check again under the exclusive lock, which orders the append against a login
+        bool offline = sessions.write(recipient, [&](auto& map) {
+            auto it = map.find(recipient);
+            if (it != map.end()) {
+                deliver(it->second);
+                return false;
+            }
+            message_log->append(LOG_PRIVATE, string(recipient), string(msg.data(), msg.size()));
+            return true;
+        });
+        if (offline) {
+            send_all(sender, Payload({recipient, " is offline; the message will be delivered when they log in."}));
+        }
+        found = true;
+    }
+    if (!found) {
+        send_all(sender, "Error: user not found.", strlen("Error: user not found."));
+    }
+}
+
+void group_message(Client& sender, string_view group_name, string_view message) {
+    GroupResult result = GROUP_MISSING;
+    groups.read(group_name, [&](const Group& group) {
+        const MemberSet& members = group.sockets;
+        if (!members.contains(sender.socket)) {
+            result = GROUP_NOT_MEMBER;
+            return;
+        }
+        result = GROUP_OK;
+        // string msg = "[Group " + group_name + "]: " + sender.username + ": " + message;
+        Payload msg({"[", sender.username, " from ", group_name, "]: ", message});
+        if (message_log) {
+            message_log->append(LOG_GROUP, string(group_name), string(msg.data(), msg.size()));
+        }
+        members.for_each([&](int member) {
+            // Skip sending the message back to the sender
+            if (member != sender.socket) {
+                send_all(member, msg);
+            }
+        });
+        forward_to_group(group, msg);
+        metrics().fanout.observe(members.size() - 1);
+    });
+    if (result == GROUP_MISSING) {
+        send_all(sender, "Error: group does not exist.", strlen("Error: group does not exist."));
+    } else if (result == GROUP_NOT_MEMBER) {
+        send_all(sender, "Error: you are not a member of this group.", strlen("Error: you are not a member of this group."));
+    }
+}
+
+// Everything a link starts with after the hello: this node's online users and their groups
+string cluster_snapshot() {
+    string snapshot;
+    sessions.for_each([&](const string& username, const vector<shared_ptr<Client>>&) {
+        append_cluster_frame(snapshot, CLUSTER_USER_ON, username, {});
+    });
+    groups.for_each([&](const Group& group) {
+        group.sockets.for_each([&](int socket) {
+            clients.read(socket, [&](const shared_ptr<Client>& client) {
+                append_cluster_frame(snapshot, CLUSTER_JOIN, group.name, client->username);
+            });
+        });
+    });
+    return snapshot;
+}
+
+string cluster_hello() {
+    string hello;
+    char node[2] = {(char)(node_id >> 8), (char)node_id};
+    append_cluster_frame(hello, CLUSTER_HELLO, {}, string_view(node, 2));
+    return hello;
+}
+
+bool write_fully(int socket, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    bump(metrics().cluster_bytes_sent, data.size());
+    return true;
+}
+
+struct ClusterFrame {
+    ClusterFrameType type;
+    string_view key;
+    string_view value;
+};
+
+// Reads the frames of one link from a blocking socket
+struct ClusterReader {
+    int socket;
+    string buffer;
+    size_t pos = 0;
+
+    // The next frame, valid until the following call. False on EOF, error or a malformed frame.
+    bool next(ClusterFrame& frame) {
+        while (true) {
+            if (buffer.size() - pos >= FRAME_HEADER_SIZE) {
+                uint32_t length = decode_frame_header(buffer.data() + pos);
+                if (length < 5 || length > 2 * MAX_MSG_SIZE) return false;
+                if (buffer.size() - pos - FRAME_HEADER_SIZE >= length) {
+                    const char* body = buffer.data() + pos + FRAME_HEADER_SIZE;
+                    uint32_t key_length = decode_frame_header(body + 1);
+                    if (key_length > length - 5) return false;
+                    frame.type = (ClusterFrameType)body[0];
+                    frame.key = string_view(body + 5, key_length);
+                    frame.value = string_view(body + 5 + key_length, length - 5 - key_length);
+                    pos += FRAME_HEADER_SIZE + length;
+                    bump(metrics().cluster_frames_received);
+                    return true;
+                }
+            }
+            buffer.erase(0, pos);
+            pos = 0;
+            size_t used = buffer.size();
+            buffer.resize(used + BUFFER_SIZE);
+            ssize_t n = recv(socket, &buffer[used], BUFFER_SIZE, 0);
+            buffer.resize(used + max<ssize_t>(n, 0));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            bump(metrics().cluster_bytes_received, n);
+        }
+    }
+};
+
+int decode_hello(const ClusterFrame& frame) {
+    if (frame.type != CLUSTER_HELLO || frame.value.size() != 2) return -1;
+    return (unsigned char)frame.value[0] << 8 | (unsigned char)frame.value[1];
+}
+
+// What one peer told this node over its current link, so that it can be undone when the
+// link drops. Also filters repeated frames, which keeps the registries exact.
+struct PeerState {
+    int node;
+    unordered_set<string> online;
+    unordered_map<string, unordered_set<string>> joined;    // Group → usernames
+};
+
+void remove_remote_user(int node, string_view username) {
+    remote_users.write(username, [&](auto& map) {
+        auto it = map.find(username);
+        if (it == map.end()) return;
+        erase(it->second, node);
+        if (it->second.empty()) map.erase(it);
+    });
+}
+
+void remove_remote_member(int node, string_view group_name, const string& username) {
+    groups.modify(group_name, false, [&](uint32_t, Group& group, bool) {
+        auto it = group.remote.find(node);
+        if (it != group.remote.end() && it->second.erase(username) && it->second.empty()) {
+            group.remote.erase(it);
+        }
+        return GROUP_OK;
+    });
+}
+
+void apply_cluster_frame(PeerState& state, const ClusterFrame& frame) {
+    int node = state.node;
+    switch (frame.type) {
+    case CLUSTER_USER_ON:
+        if (state.online.emplace(frame.key).second) {
+            remote_users.write(frame.key, [&](auto& map) { map[string(frame.key)].push_back(node); });
+        }
+        break;
+    case CLUSTER_USER_OFF:
+        if (state.online.erase(string(frame.key))) {
+            remove_remote_user(node, frame.key);
+        }
+        break;
+    case CLUSTER_JOIN:
+        if (state.joined[string(frame.key)].emplace(frame.value).second) {
+            groups.modify(frame.key, true, [&](uint32_t, Group& group, bool) {
+                group.remote[node].emplace(frame.value);
+                return GROUP_OK;
+            });
+        }
+        break;
+    case CLUSTER_LEAVE: {
+        auto it = state.joined.find(string(frame.key));
+        string username(frame.value);
+        if (it != state.joined.end() && it->second.erase(username)) {
+            if (it->second.empty()) state.joined.erase(it);
+            remove_remote_member(node, frame.key, username);
+        }
+        break;
+    }
+    case CLUSTER_PRIVATE: {
+        Payload msg({frame.value});
+        sessions.read(frame.key, [&](const vector<shared_ptr<Client>>& connections) {
+            for (const auto& connection : connections) {
+                send_all(*connection, msg);
+            }
+            metrics().fanout.observe(connections.size());
+        });
+        break;
+    }
+    case CLUSTER_GROUP: {
+        Payload msg({frame.value});
+        groups.read(frame.key, [&](const Group& group) {
+            group.sockets.for_each([&](int member) { send_all(member, msg); });
+            metrics().fanout.observe(group.sockets.size());
+        });
+        break;
+    }
+    case CLUSTER_BROADCAST:
+        broadcast_message(Payload({frame.value}), -1, false);
+        break;
+    case CLUSTER_PRESENCE: {
+        Payload msg({frame.value});
+        if (frame.key.empty()) {
+            deliver_presence(nullptr, msg);
+        } else {
+            groups.read(frame.key, [&](const Group& group) { deliver_presence(&group, msg); });
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// The link a node opened to this one. A new link from a node replaces its previous one,
+// whose reader is shut down and finishes undoing its state first.
+struct Inbound {
+    mutex lifetime;             // Held by the reader of the node's current link
+    int socket = -1;            // Guarded by inbound_mutex
+    uint64_t generation = 0;    // Guarded by inbound_mutex; newest link wins
+};
+mutex inbound_mutex;
+map<int, unique_ptr<Inbound>> inbound;  // Node → link
+
+void read_peer(int socket) {
+    ClusterReader reader{socket, {}};
+    ClusterFrame frame;
+    int node = reader.next(frame) ? decode_hello(frame) : -1;
+    if (node < 0 || node == node_id || !write_fully(socket, cluster_hello())) {
+        close(socket);
+        return;
+    }
+    Inbound* link;
+    uint64_t generation;
+    {
+        lock_guard<mutex> lock(inbound_mutex);
+        unique_ptr<Inbound>& entry = inbound[node];
+        if (!entry) entry = make_unique<Inbound>();
+        link = entry.get();
+        generation = ++link->generation;
+        if (link->socket >= 0) shutdown(link->socket, SHUT_RDWR);
+    }
+    {
+        lock_guard<mutex> lifetime(link->lifetime);
+        {
+            lock_guard<mutex> lock(inbound_mutex);
+            if (generation == link->generation) link->socket = socket;
+        }
+        PeerState state{node, {}, {}};
+        if (link->socket == socket) {
+            cout << "Cluster: node " << node << " connected" << endl;
+            while (reader.next(frame)) {
+                apply_cluster_frame(state, frame);
+            }
+            cout << "Cluster: node " << node << " disconnected" << endl;
+        }
+        // Its users are no longer reachable through this node
+        for (const string& username : state.online) {
+            remove_remote_user(node, username);
+        }
+        for (const auto& group : state.joined) {
+            for (const string& username : group.second) {
+                remove_remote_member(node, group.first, username);
+            }
+        }
+        lock_guard<mutex> lock(inbound_mutex);
+        if (link->socket == socket) link->socket = -1;
+    }
+    close(socket);
+}
+
+void accept_peers(int listen_socket) {
+    while (true) {
+        int socket = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket < 0) continue;
+        thread(read_peer, socket).detach();
+    }
+}
+
+// Connect to a peer and exchange hellos. Returns the socket, or -1.
+int connect_peer(Peer& peer) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* address = nullptr;
+    if (getaddrinfo(peer.host.c_str(), peer.port.c_str(), &hints, &address) != 0) return -1;
+    int socket = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool connected = socket >= 0 && connect(socket, address->ai_addr, address->ai_addrlen) == 0;
+    freeaddrinfo(address);
+    if (connected) {
+        int one = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ClusterReader reader{socket, {}};
+        ClusterFrame frame;
+        connected = write_fully(socket, cluster_hello()) && reader.next(frame) && decode_hello(frame) >= 0;
+        if (connected) peer.node = decode_hello(frame);
+    }
+    if (!connected && socket >= 0) {
+        close(socket);
+        socket = -1;
+    }
+    return socket;
+}
+
+// Keep the link to one peer up and write everything queued for it. Frames queued while the
+// previous batch was being written go out together in the next write.
+void run_peer(Peer& peer) {
+    while (true) {
+        int socket = connect_peer(peer);
+        if (socket < 0) {
+            this_thread::sleep_for(chrono::milliseconds(CLUSTER_RETRY_MS));
+            continue;
+        }
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(peer.out_mutex, LOCK_CLUSTER);
+            peer.connected = true;
+            peer.overflowed = false;
+            peer.outbuf.clear();
+        }
+        peers_connected++;
+        cout << "Cluster: linked to node " << peer.node << " at " << peer.host << ":" << peer.port << endl;
+
+        string batch = cluster_snapshot();
+        bool ok = true;
+        while (ok) {
+            ok = write_fully(socket, batch);
+            batch.clear();
+            auto lock = timed_lock<unique_lock<mutex>>(peer.out_mutex, LOCK_CLUSTER);
+            while (ok && peer.outbuf.empty() && !peer.overflowed) {
+                // The peer never writes on this link, so readability means it went away
+                peer.ready.wait_for(lock, chrono::milliseconds(CLUSTER_RETRY_MS));
+                pollfd closed{socket, POLLIN, 0};
+                ok = poll(&closed, 1, 0) == 0;
+            }
+            ok = ok && !peer.overflowed;
+            batch.swap(peer.outbuf);
+        }
+
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(peer.out_mutex, LOCK_CLUSTER);
+            peer.connected = false;
+            peer.outbuf.clear();
+        }
+        peers_connected--;
+        close(socket);
+        cout << "Cluster: lost the link to node " << peer.node << endl;
+    }
+}
+
+// Whitespace as `>>` on a stream sees it
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Split the next word off the front of text, skipping whitespace before it
+string_view next_word(string_view& text) {
+    size_t start = 0;
+    while (start < text.size() && is_space(text[start])) ++start;
+    size_t end = start;
+    while (end < text.size() && !is_space(text[end])) ++end;
+    string_view word = text.substr(start, end - start);
+    text.remove_prefix(end);
+    return word;
+}
+
+// The text up to the end of the line, optionally after skipping leading whitespace
+string_view rest_of_line(string_view text, bool skip_space) {
+    size_t start = 0;
+    while (skip_space && start < text.size() && is_space(text[start])) ++start;
+    text.remove_prefix(start);
+    return text.substr(0, text.find('\n'));
+}
+
+// A command split in place: target and text are views into the received message
+struct ParsedCommand {
+    CommandKind kind = CMD_INVALID;
+    string_view target;     // Recipient or group name
+    string_view text;       // Message text; for /broadcast everything after the command word
+};
+
+// Parse a command without copying it. Splits words the way the original istringstream
+// parser did, so every command behaves exactly as before.
+ParsedCommand parse_command(string_view message) {
+    ParsedCommand command;
+    command.kind = lookup_command(next_word(message));
+    switch (command.kind) {
+    case CMD_MSG:
+    case CMD_GROUP_MSG:
+        command.target = next_word(message);
+        command.text = rest_of_line(message, true);
+        break;
+    case CMD_BROADCAST:
+        command.text = rest_of_line(message, false);
+        break;
+    case CMD_CREATE_GROUP:
+    case CMD_JOIN_GROUP:
+    case CMD_LEAVE_GROUP:
+    case CMD_PRESENCE:
+        command.target = next_word(message);
+        break;
+    default:
+        break;
+    }
+    return command;
+}
+
+// Handle one command from an authenticated client. Returns false when the client asked to leave.
+bool process_command(Client& client, const ParsedCommand& command) {
+    int client_socket = client.socket;
+    const string& username = client.username;
+
+    switch (command.kind) {
+    case CMD_EXIT:
+        return false;
+
+    case CMD_MSG:
+        if (command.target.empty()) {
+            send_all(client, "Usage: /msg <username> <message>", 32);
+            return true;
+        }
+        if (command.text.empty()) {
+            send_all(client, "Error: Message cannot be empty.", strlen("Error: Message cannot be empty."));
+            return true;
+        }
+        send_private_message(client, command.target, command.text);
+        return true;
+
+    case CMD_BROADCAST: {
+        if (command.text.empty()) {
+            send_all(client, "Error: Message cannot be empty.", strlen("Error: Message cannot be empty."));
+            return true;
+        }
+        string_view msg = command.text.substr(1); // Remove leading space
+        // broadcast_message("[Broadcast] " + username + ": " + msg, client_socket);
+        broadcast_message(Payload({"[Broadcast from ", username, "]: ", msg}), client_socket);
+        return true;
+    }
+
+    case CMD_CREATE_GROUP: {
+        string_view group_name = command.target;
+        if (group_name.empty()) {
+            send_all(client, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
+            return true;
+        }
+        uint32_t group_id = 0;
+        GroupResult result = groups.modify(group_name, true, [&](uint32_t id, Group& group, bool created) {
+            if (!created) return GROUP_EXISTS;
+            group_id = id;
+            group.sockets.insert(client_socket);
+            if (message_log) {
+                group.members.insert(username);
+                message_log->append(LOG_JOIN, string(group_name), username);
+            }
+            cluster_send(CLUSTER_JOIN, group_name, username);
+            return GROUP_OK;
+        });
+        if (result == GROUP_OK) {
+            client.groups.push_back(group_id);
+            send_all(client, Payload({"Group \"", group_name, "\" created."}));
+        } else if (result == GROUP_FULL) {
+            send_all(client, "Error: Too many groups.", strlen("Error: Too many groups."));
+        } else {
+            send_all(client, "Error: Group already exists.", strlen("Error: Group already exists."));
+        }
+        return true;
+    }
+
+    case CMD_JOIN_GROUP: {
+        string_view group_name = command.target;
+        if (group_name.empty()) {
+            send_all(client, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
+            return true;
+        }
+        uint32_t group_id = 0;
+        GroupResult result = groups.modify(group_name, false, [&](uint32_t id, Group& group, bool) {
+            // Check if already in group
+            if (!group.sockets.insert(client_socket)) return GROUP_ALREADY_MEMBER;
+            group_id = id;
+            if (message_log && group.members.insert(username).second) {
+                message_log->append(LOG_JOIN, string(group_name), username);
+            }
+
+            cluster_send(CLUSTER_JOIN, group_name, username);
+            announce_presence(username, &group, true);  // Notify group members
+            return GROUP_OK;
+        });
+        if (result == GROUP_OK) {
+            client.groups.push_back(group_id);
+            send_all(client, Payload({"You joined the group ", group_name, "."}));
+        } else if (result == GROUP_ALREADY_MEMBER) {
+            send_all(client, "You are already in this group.", 31);
+        } else {
+            send_all(client, "Error: Group does not exist.", strlen("Error: Group does not exist."));
+        }
+        return true;
+    }
+
+    case CMD_LEAVE_GROUP: {
+        string_view group_name = command.target;
+        if (group_name.empty()) {
+            send_all(client, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
+            return true;
+        }
+        uint32_t group_id = 0;
+        GroupResult result = groups.modify(group_name, false, [&](uint32_t id, Group& group, bool) {
+            if (!group.sockets.erase(client_socket)) return GROUP_NOT_MEMBER;
+            group_id = id;
+            if (message_log && group.members.erase(username)) {
+                message_log->append(LOG_LEAVE, string(group_name), username);
+            }
+
+            if (!other_session_in_group(client, group)) {
+                cluster_send(CLUSTER_LEAVE, group_name, username);
+            }
+
+            // Notify group members; the group is deleted if it is now empty
+            announce_presence(username, &group, false);
+            return GROUP_OK;
+        });
+        if (result == GROUP_OK) {
+            client.groups.erase(find(client.groups.begin(), client.groups.end(), group_id));
+            send_all(client, Payload({"You left the group ", group_name, "."}));
+        } else if (result == GROUP_NOT_MEMBER) {
+            send_all(client, "Error: You are not in this group.", strlen("Error: You are not in this group."));
+        } else {
+            send_all(client, "Error: Group does not exist.", strlen("Error: Group does not exist."));
+        }
+        return true;
+    }
+
+    case CMD_GROUP_MSG:
+        if (command.target.empty()) {
+            send_all(client, "Usage: /group_msg <group_name> <message>", 39);
+            return true;
+        }
+        if (command.text.empty()) {
+            send_all(client, "Error: Message cannot be empty.", 24);
+            return true;
+        }
+        group_message(client, command.target, command.text);
+        return true;
+
+    case CMD_PRESENCE:
+        if (command.target == "on" || command.target == "off") {
+            client.presence = command.target == "on";
+            send_all(client, Payload({"Presence notices ", command.target, "."}));
+        } else {
+            send_all(client, "Usage: /presence on|off", strlen("Usage: /presence on|off"));
+        }
+        return true;
+
+    default: {
+        const char* error_msg = "Error: Invalid Command.";
+        send_all(client, error_msg, strlen(error_msg));
+        return true;
+    }
+    }
+}
+
+// The parser before parse_command: an istringstream per message, copies of every word
+// and a linear scan of the command names. Kept for --bench-parser.
+ParsedCommand legacy_parse(const string& message, string& target, string& text) {
+    istringstream iss(message);
+    string command;
+    iss >> command;
+    ParsedCommand parsed;
+    for (int kind = 0; kind < CMD_INVALID; ++kind) {
+        if (command == command_names[kind]) parsed.kind = (CommandKind)kind;
+    }
+    target.clear();
+    text.clear();
+    if (parsed.kind == CMD_MSG || parsed.kind == CMD_GROUP_MSG) {
+        iss >> target;
+        getline(iss >> ws, text);
+    } else if (parsed.kind == CMD_BROADCAST) {
+        getline(iss, text);
+    } else if (parsed.kind != CMD_EXIT && parsed.kind != CMD_INVALID) {
+        iss >> target;
+    }
+    parsed.target = target;
+    parsed.text = text;
+    return parsed;
+}
+
+// Time both parsers over a representative mix of commands and check they agree
+int bench_parser(int rounds) {
+    const vector<string> messages = {
+        "/msg bob hey, are you coming to the review at three?",
+        "/group_msg team  build 1432 is green, deploying to staging now",
+        "/msg carol ok",
+        "/broadcast server restarts in five minutes",
+        "/join_group team",
+        "/leave_group team",
+        "/create_group ops",
+        "/nosuch command",
+    };
+    string target, text;
+    for (const string& message : messages) {
+        ParsedCommand fast = parse_command(message);
+        ParsedCommand slow = legacy_parse(message, target, text);
+        if (fast.kind != slow.kind || fast.target != slow.target || fast.text != slow.text) {
+            cerr << "Error: Parsers disagree on \"" << message << "\"" << endl;
+            return 1;
+        }
+    }
+
+    size_t checksum = 0;
+    int64_t start = now_ns();
+    for (int round = 0; round < rounds; ++round) {
+        for (const string& message : messages) {
+            ParsedCommand parsed = legacy_parse(message, target, text);
+            checksum += parsed.kind + parsed.target.size() + parsed.text.size();
+        }
+    }
+    int64_t legacy_ns = now_ns() - start;
+    start = now_ns();
+    for (int round = 0; round < rounds; ++round) {
+        for (const string& message : messages) {
+            ParsedCommand parsed = parse_command(message);
+            checksum -= parsed.kind + parsed.target.size() + parsed.text.size();
+        }
+    }
+    int64_t parse_ns = now_ns() - start;
+
+    double count = (double)rounds * messages.size();
+    cout << fixed << setprecision(1);
+    cout << "istringstream parser: " << legacy_ns / count << " ns/message" << endl;
+    cout << "in-place parser:      " << parse_ns / count << " ns/message" << endl;
+    cout << "speedup:              " << (double)legacy_ns / max<int64_t>(parse_ns, 1) << "x" << endl;
+    return checksum == 0 ? 0 : 1;
+}
+
+// Complete a login once the password was checked. Returns false when the connection must be closed.
+bool finish_login(const shared_ptr<Client>& client, bool password_ok) {
+    const string& username = client->username;
+    if (!password_ok) {
+        bump(metrics().auth_failed);
+        send_all(*client, "Authentication failed.", 22);
+        return false;
+    }
+    // Check the session limit and register this session in one step
+    uint64_t private_end = 0;
+    size_t session_count = sessions.write(username, [&](auto& map) -> size_t {
+        vector<shared_ptr<Client>>& connections = map[username];
+        if (connections.size() >= max_sessions) return 0;
+        if (!limits_file.empty()) {
+            client->buckets = connections.empty() ? make_shared<UserBuckets>() : connections.front()->buckets;
+        }
+        connections.push_back(client);
+        if (message_log) private_end = message_log->tail();  // Later messages arrive live
+        if (connections.size() == 1) cluster_send(CLUSTER_USER_ON, username, {});
+        return connections.size();
+    });
+    if (session_count == 0) {
+        bump(metrics().auth_duplicate);
+        send_all(*client, "Already Logged In!", strlen("Already Logged In!"));
+        return false;
+    }
+    bump(metrics().auth_ok);
+    metrics().auth_ns.observe(now_ns() - client->accepted_ns);
+
+    send_all(*client, "Welcome to the chat server!", strlen("Welcome to the chat server!"));
+    client->state = AUTHENTICATED;
+    unauthenticated--;
+
+    clients.insert_or_assign(client->socket, client);
+
+    // Rejoin the user's groups and stream what arrived while they were away
+    if (message_log) {
+        vector<pair<string, uint64_t>> group_ends;
+        for (const string& group_name : message_log->user_groups(username)) {
+            groups.modify(group_name, true, [&](uint32_t id, Group& group, bool) {
+                group.members.insert(username);
+                group.sockets.insert(client->socket);
+                group_ends.emplace_back(group_name, message_log->tail());
+                client->groups.push_back(id);
+                cluster_send(CLUSTER_JOIN, group_name, username);
+                return GROUP_OK;
+            });
+        }
+        if (session_count == 1) {
+            message_log->request_replay(client, private_end, group_ends);
+        }
+    }
+
+    // Other users only hear about a user's first session
+    if (session_count == 1) {
+        announce_presence(username, nullptr, true);
+    }
+    return true;
+}
+
+// Password checks waiting for an auth worker. The queue is bounded so a flood of logins
+// is turned away instead of growing without limit.
+struct AuthJob {
+    shared_ptr<Client> client;
+    string password;
+    shared_ptr<const Credentials> credentials;  // The table the login started with
+};
+
+mutex auth_mutex;
+condition_variable auth_ready;
+deque<AuthJob> auth_queue;
+
+bool submit_auth(AuthJob job) {
+    auto lock = timed_lock<unique_lock<mutex>>(auth_mutex, LOCK_AUTH);
+    if (auth_queue.size() >= AUTH_QUEUE_LIMIT) return false;
+    auth_queue.push_back(std::move(job));
+    auth_ready.notify_one();
+    return true;
+}
+
+// Verify passwords off the reactor threads and hand each verdict back to the client's reactor
+void auth_worker() {
+    while (true) {
+        AuthJob job;
+        {
+            unique_lock<mutex> lock(auth_mutex);
+            auth_ready.wait(lock, [] { return !auth_queue.empty(); });
+            job = std::move(auth_queue.front());
+            auth_queue.pop_front();
+        }
+        int64_t start = now_ns();
+        bool ok = job.credentials->verify(job.client->username, job.password);
+        metrics().auth_hash_ns.observe(now_ns() - start);
+        Reactor& reactor = *job.client->reactor;
+        post_to_reactor(reactor, &Reactor::pending_auth, AuthResult{std::move(job.client), ok});
+    }
+}
+
+// Advance the login handshake or run a command. Returns false when the connection must be closed.
+bool handle_message(const shared_ptr<Client>& client, string_view message) {
+    switch (client->state) {
+    case AWAIT_USERNAME:
+        // "/login <username> <password>" logs in with one message, so a client can send it
+        // together with its first commands instead of waiting for the prompts
+        if (message.compare(0, 7, "/login ") == 0) {
+            size_t space = message.find(' ', 7);
+            if (space == string::npos || space == 7) {
+                send_all(*client, "Usage: /login <username> <password>", strlen("Usage: /login <username> <password>"));
+                return false;
+            }
+            client->username = message.substr(7, space - 7);
+            client->state = AWAIT_PASSWORD;
+            return handle_message(client, message.substr(space + 1));
+        }
+        client->username = message;
+        send_all(*client, "Enter password: ", 16);
+        client->state = AWAIT_PASSWORD;
+        return true;
+
+    case AWAIT_PASSWORD: {
+        shared_ptr<const Credentials> table = users.load();
+        if (!table->hashed()) {
+            return finish_login(client, table->verify(client->username, message));
+        }
+        // Hashing is slow: verify on an auth worker and finish in complete_login
+        client->state = AUTH_PENDING;
+        if (!submit_auth(AuthJob{client, string(message), std::move(table)})) {
+            bump(metrics().auth_busy);
+            send_all(*client, "Error: Server busy, try again later.", strlen("Error: Server busy, try again later."));
+            return false;
+        }
+        return true;
+    }
+
+    case AUTH_PENDING:
+        // Pipelined commands wait for the verdict
+        if (client->deferred_input.size() >= MAX_DEFERRED_INPUT) return false;
+        client->deferred_input.emplace_back(message);
+        return true;
+
+    case AUTHENTICATED: {
+        int64_t start = now_ns();
+        ParsedCommand command = parse_command(message);
+        Metrics& stats = metrics();
+        if (client->buckets && command.kind != CMD_EXIT && !client->buckets->take(client->username, command.kind)) {
+            bump(stats.rate_limited[command.kind]);
+            send_all(*client, "Error: Rate limit exceeded, slow down.", strlen("Error: Rate limit exceeded, slow down."));
+            return true;
+        }
+        bool keep = process_command(*client, command);
+        bump(stats.commands[command.kind]);
+        stats.command_ns[command.kind].observe(now_ns() - start);
+        return keep;
+    }
+    }
+    return false;
+}
+
+void disconnect_client(Reactor& reactor, const shared_ptr<Client>& client) {
+    int client_socket = client->socket;
+    bool authenticated = client->state == AUTHENTICATED;
+    if (!authenticated) {
+        unauthenticated--;
+    }
+    // Where the log stood before this connection stopped receiving
+    uint64_t logout_offset = authenticated && message_log ? message_log->tail() : 0;
+
+    if (authenticated) {
+        remove_client_from_groups(*client);  // Remove from all groups
+        clients.erase(client_socket);
+    }
+
+    vector<shared_ptr<Client>> blocked;
+    bool drained;
+    {
+        // Closing under out_mutex keeps other threads from queueing to a reused descriptor
+        auto lock = timed_lock<unique_lock<mutex>>(client->out_mutex, LOCK_OUTQ);
+        if (!client->overflowed && !client->send_armed) {
+            write_queue_locked(*client);  // Best effort for replies such as "Authentication failed."
+        }
+        drained = client->out_count == 0;
+        client->closed = true;
+        OutQueue().swap(client->outq);
+        client->out_count = 0;
+        // Any zerocopy sends still in flight belong to a connection being torn down
+        client->zc_inflight.clear();
+        blocked.swap(client->blocked_senders);
+        if (reactor.uring) {
+            shutdown(client_socket, SHUT_RDWR);  // Ends the receive and send still in flight
+        }
+        close(client_socket);  // Properly close the socket
+    }
+    reactor.connections.erase(client_socket);
+    client->held_input.clear();
+    bump(metrics().closes);
+    for (const auto& sender : blocked) {
+        resume_sender(sender);
+    }
+
+    if (authenticated) {
+        bool last_session = sessions.write(client->username, [&](auto& map) {
+            auto it = map.find(client->username);
+            if (it == map.end()) return false;
+            vector<shared_ptr<Client>>& connections = it->second;
+            connections.erase(remove(connections.begin(), connections.end(), client), connections.end());
+            if (!connections.empty()) return false;
+            map.erase(it);
+            cluster_send(CLUSTER_USER_OFF, client->username, {});
+            return true;
+        });
+        bump(metrics().logouts);
+        // Everything up to logout_offset reached the socket, unless a backlog was still
+        // being streamed or the queue could not be flushed; then it is all sent again
+        if (last_session && message_log && drained && !client->replaying) {
+            message_log->append(LOG_CURSOR, client->username, to_string(logout_offset));
+        }
+        if (last_session) {
+            announce_presence(client->username, nullptr, false);
         }
     }
 }
 
-ssize_t send_all(int socket, const char* buffer, size_t length) {
-    if(length > MAX_MSG_SIZE){
-        send(socket, "Error: Message too long.", strlen("Error: Message too long."), 0);
-        return -1;
+// Feed received bytes to a connection. In text mode every read is one message, as before;
+// framed connections reassemble complete frames in inbuf, so several pipelined commands
+// can arrive in one read and a large message can span many reads.
+bool on_input(const shared_ptr<Client>& client, const char* data, size_t length) {
+    InputBuffer& inbuf = client->inbuf;
+    if (!client->framed) {
+        // A greeting answer starting with NUL can only be the framing hello
+        if (client->state != AWAIT_USERNAME || (inbuf.empty() && data[0] != '\0')) {
+            return handle_message(client, string_view(data, length));
+        }
+        inbuf.append(data, length);
+        if (inbuf.size() < FRAME_HELLO_LEN) {
+            return true;  // Wait for the rest of the hello
+        }
+        if (inbuf.compare(0, FRAME_HELLO_LEN, FRAME_HELLO, FRAME_HELLO_LEN) != 0) {
+            send_all(*client, "Error: Invalid protocol hello.", strlen("Error: Invalid protocol hello."));
+            return false;
+        }
+        inbuf.erase(0, FRAME_HELLO_LEN);
+        {
+            // The greeting may still be queued; it goes out as text, everything after framed
+            auto lock = timed_lock<unique_lock<mutex>>(client->out_mutex, LOCK_OUTQ);
+            client->unframed = client->out_count;
+            client->framed = true;
+        }
+        send_all(*client, "Enter username: ", 16);
+    } else {
+        inbuf.append(data, length);
     }
-    size_t total_sent = 0;  // Bytes sent so far
-    while (total_sent < length) {
-        ssize_t bytes_sent = send(socket, buffer + total_sent, BUFFER_SIZE, 0);
-        
-        if (bytes_sent < 0) {
-            if (errno == EINTR) {
-                continue;  // Retry if interrupted
+
+    size_t pos = 0;
+    bool keep = true;
+    while (keep && inbuf.size() - pos >= FRAME_HEADER_SIZE) {
+        uint32_t frame_length = decode_frame_header(inbuf.data() + pos);
+        if (frame_length > MAX_MSG_SIZE) {
+            send_all(*client, "Error: Message too long.", strlen("Error: Message too long."));
+            return false;
+        }
+        if (inbuf.size() - pos - FRAME_HEADER_SIZE < frame_length) {
+            inbuf.reserve(pos + FRAME_HEADER_SIZE + frame_length);
+            break;
+        }
+        keep = handle_message(client, string_view(inbuf).substr(pos + FRAME_HEADER_SIZE, frame_length));
+        pos += FRAME_HEADER_SIZE + frame_length;
+    }
+    inbuf.erase(0, pos);
+    return keep;
+}
+
+// Drain the socket (edge-triggered). Reading stops early while the client is paused by
+// backpressure; resume_sender reads the rest. Returns false when the peer disconnected or
+// asked to leave.
+bool read_client(const shared_ptr<Client>& client, char* buffer) {
+    while (true) {
+        if (client->pause_count > 0) {
+            client->read_paused = true;
+            return true;
+        }
+        ssize_t bytes_received = recv(client->socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received > 0) {
+            bump(metrics().bytes_received, bytes_received);
+            current_client = client;
+            bool keep = on_input(client, buffer, bytes_received);
+            current_client.reset();
+            if (!keep) {
+                return false;
             }
-            cerr << "Error sending data: " << strerror(errno) << endl;
-            return -1;  // Failure
+        } else if (bytes_received == 0) {
+            return false;  // Client disconnected
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
-        
-        total_sent += bytes_sent;
     }
-    return total_sent;  // Return the total bytes sent
 }
 
+// Release payloads whose MSG_ZEROCOPY sends the kernel reports as complete. If the kernel
+// had to copy anyway (loopback, some NICs) zerocopy only adds overhead, so it is turned off.
+void reap_zerocopy_locked(Client& client) {
+    while (!client.zc_inflight.empty()) {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(client.socket, &msg, MSG_ERRQUEUE) < 0) {
+            return;  // Nothing more on the error queue
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            uint32_t lo = err.ee_info, hi = err.ee_data;
+            erase_if(client.zc_inflight, [lo, hi](const pair<uint32_t, Payload>& entry) {
+                return entry.first - lo <= hi - lo;  // Wrap-safe lo <= seq <= hi
+            });
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                client.zerocopy = false;
+            }
+        }
+    }
+}
 
-void remove_client_from_groups(int client_socket) {
-    if (client_groups.find(client_socket) == client_groups.end()) {
-        return;  // Client is not in any group
+void uring_hold(Client& client) {
+    if (client.uring_ops++ == 0) {
+        client.uring_pin = client.shared_from_this();
     }
-    std::lock_guard<std::mutex> lock(groups_mutex);
-    // std::lock_guard<std::mutex> lock(client_groups_mutex);
+}
 
-    for (const string& group_name : client_groups[client_socket]) {
-        groups[group_name].erase(client_socket);  // Remove client from the group
-        
-        // If group is empty, delete it
-        if (groups[group_name].empty()) {
-            groups.erase(group_name);
-        }
+void uring_release(Client& client) {
+    if (--client.uring_ops == 0) {
+        client.uring_pin.reset();
     }
+}
 
-    // Remove client entry from tracking map
-    client_groups.erase(client_socket);
+// Start a multishot receive that fills buffers from the reactor's provided-buffer ring
+void arm_recv(Reactor& reactor, Client& client) {
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client.socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)&client | URING_RECV;
+    client.recv_armed = true;
+    uring_hold(client);
 }
 
+void cancel_recv(Reactor& reactor, Client& client) {
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)&client | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+}
 
-void broadcast_message(const string& message, int exclude_socket = -1) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (const auto& client : clients) {
-        if (client.first != exclude_socket) {
-            send_all(client.first, message.c_str(), message.size());
-        }
+void arm_accept(Reactor& reactor) {
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor.listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+}
+
+void arm_wake(Reactor& reactor) {
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor.wake_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_WAKE;
+}
+
+void arm_timer(Reactor& reactor) {
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = reactor.timer_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TIMER;
+}
+
+// Queue a sendmsg for the head of the queue on the owner's ring. It is submitted together
+// with every other send of this round in the reactor's next io_uring_enter.
+void submit_send_locked(Client& client) {
+    Reactor& reactor = *client.reactor;
+    if (!client.uring_send) {
+        client.uring_send = make_unique<UringSend>();
+    }
+    UringSend& send = *client.uring_send;
+    size_t bytes;
+    size_t count = gather_queue_locked(client, send.iov, bytes, FLUSH_QUANTUM);
+    for (size_t i = 0; i < count; ++i) {
+        send.payloads[i] = client.outq[(client.out_head + i) & (client.outq.size() - 1)];
     }
+    send.msg = msghdr{};
+    send.msg.msg_iov = send.iov;
+    send.msg.msg_iovlen = count;
+
+    io_uring_sqe* sqe = reactor.uring->get_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client.socket;
+    sqe->addr = (uint64_t)&send.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)&client | URING_SEND;
+    client.send_armed = true;
+    reactor.sends_submitted = true;
+    uring_hold(client);
 }
 
-void send_private_message(int sender_socket, const string& recipient, const string& message) {
-    lock_guard<mutex> lock(clients_mutex);
-    for (const auto& client : clients) {
-        if (client.second == recipient) {
-            string msg = "[" + clients[sender_socket] + "]: " + message;
-            send_all(client.first, msg.c_str(), msg.size());
-            return;
+// A sendmsg finished: retire what it wrote, send the rest and resume paused senders
+void on_send_complete(const shared_ptr<Client>& client, int res) {
+    vector<shared_ptr<Client>> resumed;
+    {
+        auto lock = timed_lock<unique_lock<mutex>>(client->out_mutex, LOCK_OUTQ);
+        UringSend& send = *client->uring_send;
+        for (size_t i = 0; i < send.msg.msg_iovlen; ++i) {
+            send.payloads[i].reset();
+        }
+        client->send_armed = false;
+        if (client->closed || client->overflowed) return;
+        if (res < 0) {
+            // The peer is gone; drop the backlog and let the read side disconnect it
+            OutQueue().swap(client->outq);
+            client->out_count = 0;
+            client->out_offset = 0;
+        } else {
+            retire_written_locked(*client, res);
+            if (client->out_count > 0) {
+                submit_send_locked(*client);
+            }
         }
+        if (client->out_count <= max_outq / 2) {
+            resumed.swap(client->blocked_senders);
+        }
+    }
+    for (const auto& sender : resumed) {
+        resume_sender(sender);
     }
-    send_all(sender_socket, "Error: user not found.", strlen("Error: user not found."));
 }
 
-void group_message(int sender_socket, const string& group_name, const string& message) {
-    lock_guard<mutex> lock(groups_mutex);
-    if (groups.find(group_name) == groups.end()) {
-        send_all(sender_socket, "Error: group does not exist.", strlen("Error: group does not exist."));
-        return;
+// Input side of an io_uring connection. Data is handled like a read in the epoll backend;
+// while the client is paused by backpressure it is held and the receive is cancelled.
+void on_recv_complete(Reactor& reactor, const shared_ptr<Client>& client, int res, uint32_t flags) {
+    bool more = flags & IORING_CQE_F_MORE;
+    if (!more) {
+        client->recv_armed = false;
     }
-    if (groups[group_name].find(sender_socket) == groups[group_name].end()) {
-        send_all(sender_socket, "Error: you are not a member of this group.", strlen("Error: you are not a member of this group."));
-        return;
+    bool keep = true;
+    if (res > 0) {
+        bump(metrics().bytes_received, res);
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char* data = reactor.uring->buffer(bid);
+        if (client->closed) {
+            // Input that raced with the disconnect
+        } else if (client->read_paused || client->pause_count > 0) {
+            client->held_input.emplace_back(data, res);
+            if (!client->read_paused) {
+                client->read_paused = true;
+                if (more) cancel_recv(reactor, *client);
+            }
+        } else {
+            current_client = client;
+            keep = on_input(client, data, res);
+            current_client.reset();
+        }
+        reactor.uring->recycle_buffer(bid);
+    } else if (!client->closed && res != -ENOBUFS && res != -ECANCELED) {
+        // Peer closed or the socket failed; held input is handled first
+        if (client->read_paused) {
+            client->recv_eof = true;
+        } else {
+            keep = false;
+        }
     }
 
-    string sender_name = clients[sender_socket];
-    // string msg = "[Group " + group_name + "]: " + sender_name + ": " + message;
-    string msg = "[" + sender_name + " from " + group_name + "]: " + message;
-    for (int member : groups[group_name]) {
-        // Skip sending the message back to the sender
-        if (member != sender_socket) {
-            send_all(member, msg.c_str(), msg.size());
-        }
+    if (!keep) {
+        disconnect_client(reactor, client);
+    } else if (!more && !client->closed && !client->read_paused && !client->recv_eof) {
+        arm_recv(reactor, *client);  // Ran out of buffers, or cancelled and already resumed
+    }
+    if (!more) {
+        uring_release(*client);
     }
 }
 
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    string username;
+// Resume a paused io_uring connection: handle held input, then receive again
+bool resume_uring_input(Reactor& reactor, const shared_ptr<Client>& client) {
+    while (!client->held_input.empty()) {
+        if (client->pause_count > 0) {
+            client->read_paused = true;
+            return true;
+        }
+        string chunk = std::move(client->held_input.front());
+        client->held_input.pop_front();
+        current_client = client;
+        bool keep = on_input(client, chunk.data(), chunk.size());
+        current_client.reset();
+        if (!keep) {
+            return false;
+        }
+    }
+    if (client->recv_eof) {
+        return false;
+    }
+    if (!client->recv_armed) {
+        arm_recv(reactor, *client);
+    }
+    return true;
+}
 
-    // Authentication
-    send_all(client_socket, "Enter username: ", 16);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    username = buffer;
+// Writer side of a connection: drain its queue on the owning reactor and let paused
+// senders continue once it has room again.
+void flush_client(Reactor& reactor, const shared_ptr<Client>& client) {
+    vector<shared_ptr<Client>> resumed;
+    bool overflowed;
+    {
+        auto lock = timed_lock<unique_lock<mutex>>(client->out_mutex, LOCK_OUTQ);
+        client->flush_scheduled = false;
+        if (client->closed) return;
+        reap_zerocopy_locked(*client);
+        overflowed = client->overflowed;
+        if (!overflowed) {
+            if (reactor.uring) {
+                if (!client->send_armed && client->out_count > 0) {
+                    submit_send_locked(*client);
+                }
+            } else {
+                int written = write_queue_locked(*client);
+                if (written < 0) {
+                    // The peer is gone; drop the backlog and let the read side disconnect it
+                    OutQueue().swap(client->outq);
+                    client->out_count = 0;
+                    client->out_offset = 0;
+                } else if (written == 2) {
+                    // Deficit round-robin: go to the back of the line so one deep queue
+                    // cannot hold up the reactor's other connections
+                    bump(metrics().flush_yields);
+                    schedule_flush_locked(*client);
+                }
+            }
+            if (client->out_count <= max_outq / 2) {
+                resumed.swap(client->blocked_senders);
+            }
+        }
+    }
+    for (const auto& sender : resumed) {
+        resume_sender(sender);
+    }
+    if (overflowed) {
+        cerr << "Disconnecting slow client on socket " << client->socket << ": outbound queue overflow" << endl;
+        disconnect_client(reactor, client);
+    }
+}
 
-    send_all(client_socket, "Enter password: ", 16);
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0);
-    string password = buffer;
+// Close connections that have not logged in by their deadline, then arm the timer for the
+// next one. A login still being verified on an auth worker is waiting on us, not the client.
+void expire_handshakes(Reactor& reactor) {
+    int64_t now = now_ns();
+    while (!reactor.handshakes.empty() && reactor.handshakes.front().deadline_ns <= now) {
+        shared_ptr<Client> client = reactor.handshakes.front().client.lock();
+        reactor.handshakes.pop_front();
+        if (!client || client->closed || client->state == AUTHENTICATED) continue;
+        if (client->state == AUTH_PENDING) {
+            reactor.handshakes.push_back(Handshake{now + (int64_t)login_timeout * 1000000000, client});
+            continue;
+        }
+        bump(metrics().login_timeouts);
+        send_all(*client, "Error: Login timed out.", strlen("Error: Login timed out."));
+        disconnect_client(reactor, client);
+    }
+    if (!reactor.handshakes.empty()) {
+        int64_t wait = max<int64_t>(reactor.handshakes.front().deadline_ns - now, 1000000);
+        itimerspec spec{};
+        spec.it_value.tv_sec = wait / 1000000000;
+        spec.it_value.tv_nsec = wait % 1000000000;
+        timerfd_settime(reactor.timer_fd, 0, &spec, nullptr);
+    }
+}
 
-    if (users.find(username) == users.end() || users[username] != password) {
-        send_all(client_socket, "Authentication failed.", 22);
-        close(client_socket);
-        return;
-    }else if(active_users[username] == true){
-        send_all(client_socket, "Already Logged In!", strlen("Already Logged In!"));
+void register_client(Reactor& reactor, const Accepted& accepted) {
+    int client_socket = accepted.socket;
+    // Turn the connection away if too many others are still logging in
+    if (unauthenticated.fetch_add(1) >= max_unauthenticated) {
+        unauthenticated--;
+        bump(metrics().login_rejected);
+        bump(metrics().closes);
+        const char* busy = "Error: Server busy, try again later.";
+        ssize_t ignored = send(client_socket, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+        (void)ignored;
         close(client_socket);
         return;
     }
-    
-    send_all(client_socket, "Welcome to the chat server!", strlen("Welcome to the chat server!"));
+    auto client = allocate_shared<Client>(SlabAllocator<Client>(&reactor.slab), client_socket, &reactor);
+    client->accepted_ns = accepted.accepted_ns;
+    metrics().handoff_ns.observe(now_ns() - accepted.accepted_ns);
+    if (reactor.uring) {
+        arm_recv(reactor, *client);
+    } else {
+        if (zerocopy_enabled) {
+            int one = 1;
+            client->zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            cerr << "Error: epoll_ctl failed: " << strerror(errno) << endl;
+            unauthenticated--;
+            bump(metrics().closes);
+            close(client_socket);
+            return;
+        }
+    }
+    reactor.connections[client_socket] = client;
+    reactor.handshakes.push_back(Handshake{accepted.accepted_ns + (int64_t)login_timeout * 1000000000, client});
+    if (reactor.handshakes.size() == 1) {
+        expire_handshakes(reactor);  // Arms the timer
+    }
+    send_all(*client, "Enter username: ", 16);
+}
 
-    {
-        lock_guard<mutex> lock(clients_mutex);
-        clients[client_socket] = username;
+// Accept everything waiting on this reactor's own listener. The sockets are registered
+// with the pending ones after the batch, for the same reason as sockets from other threads.
+void accept_clients(Reactor& reactor) {
+    while (true) {
+        int client_socket = accept4(reactor.listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                cerr << "Error: Accept failed: " << strerror(errno) << endl;
+            }
+            return;
+        }
+        bump(metrics().accepts);
+        post_to_reactor(reactor, &Reactor::pending_sockets, Accepted{client_socket, now_ns()});
+    }
+}
+
+// Finish a login verified by an auth worker, then handle what the client sent meanwhile
+void complete_login(Reactor& reactor, const AuthResult& result) {
+    const shared_ptr<Client>& client = result.client;
+    auto it = reactor.connections.find(client->socket);
+    if (it == reactor.connections.end() || it->second != client) {
+        return;  // Disconnected while waiting
+    }
+    current_client = client;
+    bool keep = finish_login(client, result.ok);
+    vector<string> deferred;
+    deferred.swap(client->deferred_input);
+    for (size_t i = 0; keep && i < deferred.size(); ++i) {
+        keep = handle_message(client, deferred[i]);
     }
+    current_client.reset();
+    if (!keep) {
+        disconnect_client(reactor, client);
+    }
+}
 
+// Run the work other threads (or this reactor itself) posted since the last batch
+void run_pending(Reactor& reactor, char* buffer) {
+    vector<Accepted> sockets;
+    vector<shared_ptr<Client>> flush, resume;
+    vector<AuthResult> auth;
     {
-        lock_guard<mutex> lock(active_users_mutex);
-        active_users[username] = true;
+        auto lock = timed_lock<unique_lock<mutex>>(reactor.pending_mutex, LOCK_PENDING);
+        reactor.woken = false;
+        sockets.swap(reactor.pending_sockets);
+        flush.swap(reactor.pending_flush);
+        resume.swap(reactor.pending_resume);
+        auth.swap(reactor.pending_auth);
+    }
+
+    for (const Accepted& accepted : sockets) {
+        register_client(reactor, accepted);
+    }
+    for (const AuthResult& result : auth) {
+        complete_login(reactor, result);
+    }
+    for (const auto& client : resume) {
+        if (!client->closed && client->read_paused && client->pause_count == 0) {
+            client->read_paused = false;
+            if (!(reactor.uring ? resume_uring_input(reactor, client) : read_client(client, buffer))) {
+                disconnect_client(reactor, client);
+            }
+        }
     }
+    for (const auto& client : flush) {
+        flush_client(reactor, client);
+    }
+}
 
-    broadcast_message(username + " has joined the chat.", client_socket);
+void reactor_loop(Reactor& reactor) {
+    epoll_event events[MAX_EVENTS];
+    vector<char> buffer(BUFFER_SIZE);
+    current_reactor = &reactor;
+    Slab::current_slab = &reactor.slab;
 
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) { // Client disconnected
-            remove_client_from_groups(client_socket);  // Remove from all groups
-            close(client_socket);  // Properly close the socket
-            break;
+        // Work the reactor posted to itself while running the previous pending lists
+        // must not wait for an unrelated event
+        bool has_pending;
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(reactor.pending_mutex, LOCK_PENDING);
+            has_pending = !reactor.pending_sockets.empty() || !reactor.pending_flush.empty() ||
+                          !reactor.pending_resume.empty();
+        }
+        int n = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, has_pending ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error: epoll_wait failed: " << strerror(errno) << endl;
+            return;
         }
 
-        string message(buffer);
-        istringstream iss(message);
-        string command;
-        iss >> command;
-
-        if (command == "/exit") {
-            remove_client_from_groups(client_socket);  // Remove from all groups
-            close(client_socket);  // Properly close the socket
-            break;
-        } else if (command == "/msg") {
-            string recipient;
-            iss >> recipient;
-            if (recipient.empty()) {
-                send_all(client_socket, "Usage: /msg <username> <message>", 32);
+        // Posted work, including new sockets, runs after the batch so a stale event can never
+        // be applied to a connection that reused a descriptor closed earlier in the batch.
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == reactor.wake_fd) {
+                uint64_t count;
+                ssize_t ignored = read(reactor.wake_fd, &count, sizeof(count));
+                (void)ignored;
                 continue;
             }
-            string msg;
-            getline(iss >> ws, msg); // Skip leading whitespace and get the rest
-            if (msg.empty()) {
-                send_all(client_socket, "Error: Message cannot be empty.", strlen("Error: Message cannot be empty."));
+            if (fd == reactor.listen_fd) {
+                accept_clients(reactor);
                 continue;
             }
-            send_private_message(client_socket, recipient, msg);
-        }
-         else if (command == "/broadcast") {
-            string msg;
-            getline(iss, msg);
-            if (msg.empty()) {
-                send_all(client_socket, "Error: Message cannot be empty.", strlen("Error: Message cannot be empty."));
+            if (fd == reactor.timer_fd) {
+                uint64_t expirations;
+                ssize_t ignored = read(reactor.timer_fd, &expirations, sizeof(expirations));
+                (void)ignored;
+                expire_handshakes(reactor);
                 continue;
             }
-            msg = msg.substr(1); // Remove leading space
-            // broadcast_message("[Broadcast] " + username + ": " + msg, client_socket);
-            broadcast_message("[Broadcast from " + username + "]: " + msg, client_socket);
-        } else if (command == "/create_group") {
-            string group_name;
-            iss >> group_name;
-            if (group_name.empty()) {
-                send_all(client_socket, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
-                continue;
+            auto it = reactor.connections.find(fd);
+            if (it == reactor.connections.end()) continue;
+            shared_ptr<Client> client = it->second;
+
+            uint32_t ev = events[i].events;
+            if (ev & (EPOLLOUT | EPOLLERR)) {
+                flush_client(reactor, client);  // EPOLLERR also signals zerocopy completions
             }
-            lock_guard<mutex> lock(groups_mutex);
-            if (groups.find(group_name) == groups.end()) {
-                groups[group_name].insert(client_socket);
-                send_all(client_socket, ("Group \"" + group_name + "\" created.").c_str(), ("Group \"" + group_name + "\" created.").size());
-            } else {
-                send_all(client_socket, "Error: Group already exists.", strlen("Error: Group already exists."));
+            if (!client->closed && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                if (!read_client(client, buffer.data())) {
+                    disconnect_client(reactor, client);
+                }
             }
-        } else if (command == "/join_group") {
-            std::string group_name;
-            iss >> group_name;
-            if (group_name.empty()) {
-                send_all(client_socket, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
-                continue;
+        }
+        run_pending(reactor, buffer.data());
+    }
+}
+
+// io_uring counterpart of reactor_loop. The receives, sends and accepts queued during a
+// round all reach the kernel in the one io_uring_enter that also waits for completions.
+void uring_loop(Reactor& reactor) {
+    Uring& ring = *reactor.uring;
+    current_reactor = &reactor;
+    Slab::current_slab = &reactor.slab;
+    arm_wake(reactor);
+    arm_timer(reactor);
+    if (reactor.listen_fd >= 0) {
+        arm_accept(reactor);
+    }
+
+    while (true) {
+        bool has_pending;
+        {
+            auto lock = timed_lock<unique_lock<mutex>>(reactor.pending_mutex, LOCK_PENDING);
+            has_pending = !reactor.pending_sockets.empty() || !reactor.pending_flush.empty() ||
+                          !reactor.pending_resume.empty();
+        }
+        // Entries that did not fit wait for the completions below to make room; don't block
+        bool backed_up = ring.flush_overflow();
+        if (!has_pending || ring.to_submit > 0) {
+            if (reactor.sends_submitted) {
+                bump(metrics().write_calls);
+                reactor.sends_submitted = false;
             }
-            std::lock_guard<std::mutex> lock(groups_mutex);
-            // std::lock_guard<std::mutex> lock(client_groups_mutex);
-            if (groups.find(group_name) != groups.end()) {
-                // Check if already in group
-                if (groups[group_name].find(client_socket) != groups[group_name].end()) {
-                    send_all(client_socket, "You are already in this group.", 31);
-                } else {
-                    groups[group_name].insert(client_socket);
-                    client_groups[client_socket].insert(group_name);
-                    send_all(client_socket, ("You joined the group " + group_name + ".").c_str(), ("You joined the group " + group_name + ".").size());
-
-                    // Notify group members
-                    std::string username;
-                    {
-                        std::lock_guard<std::mutex> clock(clients_mutex);
-                        auto it = clients.find(client_socket);
-                        if (it != clients.end()) username = it->second;
-                    }
-                    if (!username.empty()) {
-                        std::string msg = username + " has joined the group " + group_name + ".";
-                        for (int member : groups[group_name]) {
-                            if (member != client_socket) {
-                                send_all(member, msg.c_str(), msg.size());
-                            }
-                        }
-                    }
-                }
-            } else {
-                send_all(client_socket, "Error: Group does not exist.", strlen("Error: Group does not exist."));
+            if (ring.enter(has_pending || backed_up ? 0 : 1) < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                cerr << "Error: io_uring_enter failed: " << strerror(errno) << endl;
+                return;
             }
-        } else if (command == "/leave_group") {
-            std::string group_name;
-            iss >> group_name;
-            if (group_name.empty()) {
-                send_all(client_socket, "Error: Group name cannot be empty", strlen("Error: Group name cannot be empty"));
-                continue;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+            Client* target = (Client*)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+            switch (cqe.user_data & URING_OP_MASK) {
+            case URING_RECV: {
+                shared_ptr<Client> client = target->uring_pin;
+                on_recv_complete(reactor, client, cqe.res, cqe.flags);
+                break;
             }
-            std::lock_guard<std::mutex> lock(groups_mutex);
-            if (groups.find(group_name) != groups.end()) {
-                if (groups[group_name].erase(client_socket)) {
-                    send_all(client_socket, ("You left the group " + group_name + ".").c_str(), ("You left the group " + group_name + ".").size());
-
-                    // Notify group members
-                    std::string username;
-                    {
-                        std::lock_guard<std::mutex> clock(clients_mutex);
-                        auto it = clients.find(client_socket);
-                        if (it != clients.end()) username = it->second;
-                    }
-                    if (!username.empty()) {
-                        std::string msg = username + " has left the group " + group_name + ".";
-                        for (int member : groups[group_name]) {
-                            send_all(member, msg.c_str(), msg.size());
-                        }
-                    }
+            case URING_SEND: {
+                shared_ptr<Client> client = target->uring_pin;
+                on_send_complete(client, cqe.res);
+                uring_release(*client);
+                break;
+            }
+            case URING_ACCEPT:
+                if (cqe.res >= 0) {
+                    bump(metrics().accepts);
+                    post_to_reactor(reactor, &Reactor::pending_sockets, Accepted{cqe.res, now_ns()});
                 } else {
-                    send_all(client_socket, "Error: You are not in this group.", strlen("Error: You are not in this group."));
+                    cerr << "Error: Accept failed: " << strerror(-cqe.res) << endl;
                 }
-            } else {
-                send_all(client_socket, "Error: Group does not exist.", strlen("Error: Group does not exist."));
+                if (!more) arm_accept(reactor);
+                break;
+            case URING_WAKE: {
+                uint64_t count;
+                ssize_t ignored = read(reactor.wake_fd, &count, sizeof(count));
+                (void)ignored;
+                if (!more) arm_wake(reactor);
+                break;
             }
-        } else if (command == "/group_msg") {
-            string group_name;
-            iss >> group_name;
-            if (group_name.empty()) {
-                send_all(client_socket, "Usage: /group_msg <group_name> <message>", 39);
-                continue;
+            case URING_TIMER: {
+                uint64_t expirations;
+                ssize_t ignored = read(reactor.timer_fd, &expirations, sizeof(expirations));
+                (void)ignored;
+                expire_handshakes(reactor);
+                if (!more) arm_timer(reactor);
+                break;
             }
-            string msg;
-            getline(iss >> ws, msg); // Skip leading whitespace
-            if (msg.empty()) {
-                send_all(client_socket, "Error: Message cannot be empty.", 24);
-                continue;
             }
-            group_message(client_socket, group_name, msg);
-        } else {
-            const char* error_msg = "Error: Invalid Command.";
-            send_all(client_socket, error_msg, strlen(error_msg));
         }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        run_pending(reactor, nullptr);
     }
+}
 
-    {
-        lock_guard<mutex> lock(clients_mutex);
-        clients.erase(client_socket);
+// Average pooled memory per open connection: its slab slot plus its input and output
+// buffers. Call with metrics_mutex held.
+uint64_t connection_memory_locked() {
+    uint64_t open = 0, bytes = 0;
+    for (const Metrics* stats : all_metrics) {
+        open += stats->accepts.load(memory_order_relaxed) - stats->closes.load(memory_order_relaxed);
+        for (MemoryUse use : {MEM_CONNECTIONS, MEM_INPUT, MEM_OUTQ}) {
+            bytes += stats->memory_bytes[use].load(memory_order_relaxed);
+        }
     }
+    return open ? bytes / open : 0;
+}
 
-    {
-        lock_guard<mutex> lock(active_users_mutex);
-        active_users[username]=false;
+// Periodically print the write-path counters, summed over all reactors
+void report_stats(int interval) {
+    uint64_t last_calls = 0, last_messages = 0, last_bytes = 0;
+    while (true) {
+        this_thread::sleep_for(chrono::seconds(interval));
+        uint64_t calls = 0, messages = 0, bytes = 0, per_connection = 0;
+        {
+            lock_guard<mutex> lock(metrics_mutex);
+            per_connection = connection_memory_locked();
+            for (const Metrics* stats : all_metrics) {
+                calls += stats->write_calls.load(memory_order_relaxed);
+                messages += stats->messages_written.load(memory_order_relaxed);
+                bytes += stats->bytes_written.load(memory_order_relaxed);
+            }
+        }
+        uint64_t d_calls = calls - last_calls, d_messages = messages - last_messages;
+        cout << "Stats: " << d_messages << " messages, " << bytes - last_bytes << " bytes in "
+             << d_calls << " write calls (" << (d_messages ? (double)d_calls / d_messages : 0.0)
+             << " calls/message), " << per_connection << " bytes/connection" << endl;
+        last_calls = calls;
+        last_messages = messages;
+        last_bytes = bytes;
+    }
+}
+
+// Render the summed metrics of all threads in the Prometheus text exposition format
+string format_metrics() {
+    lock_guard<mutex> lock(metrics_mutex);
+    ostringstream out;
+    auto total = [](auto field) {
+        uint64_t value = 0;
+        for (const Metrics* stats : all_metrics) value += field(*stats).load(memory_order_relaxed);
+        return value;
+    };
+    auto header = [&](const string& name, const char* type, const char* help) {
+        out << "# HELP chat_" << name << " " << help << "\n# TYPE chat_" << name << " " << type << "\n";
+    };
+    auto counter = [&](const string& name, const char* help, auto field) {
+        header(name, "counter", help);
+        out << "chat_" << name << " " << total(field) << "\n";
+    };
+    // Time histograms are exported in seconds, with buckets from ~1us to ~17s;
+    // count histograms use buckets 1, 2, 4, ... 2^20.
+    auto histogram = [&](const string& name, const string& labels, bool seconds, auto field) {
+        string prefix = labels.empty() ? "{" : "{" + labels + ",";
+        int first = seconds ? 10 : 0, last = seconds ? 34 : 20;
+        uint64_t cumulative = 0;
+        for (int bits = 0; bits < HIST_BUCKETS; ++bits) {
+            cumulative += total([&](const Metrics& m) -> const atomic<uint64_t>& { return field(m).buckets[bits]; });
+            if (bits < first || bits > last) continue;
+            uint64_t bound = 1ull << bits;   // Bucket `bits` holds values below 2^bits
+            out << "chat_" << name << "_bucket" << prefix << "le=\"";
+            if (seconds) out << bound / 1e9; else out << bound - 1;
+            out << "\"} " << cumulative << "\n";
+        }
+        uint64_t count = total([&](const Metrics& m) -> const atomic<uint64_t>& { return field(m).count; });
+        uint64_t sum = total([&](const Metrics& m) -> const atomic<uint64_t>& { return field(m).sum; });
+        out << "chat_" << name << "_bucket" << prefix << "le=\"+Inf\"} " << count << "\n";
+        string suffix = labels.empty() ? "" : "{" + labels + "}";
+        out << "chat_" << name << "_sum" << suffix << " ";
+        if (seconds) out << sum / 1e9; else out << sum;
+        out << "\nchat_" << name << "_count" << suffix << " " << count << "\n";
+    };
+#define FIELD(f) [](const Metrics& m) -> const auto& { return m.f; }
+
+    uint64_t accepts = total(FIELD(accepts)), closes = total(FIELD(closes));
+    uint64_t logins = total(FIELD(auth_ok)), logouts = total(FIELD(logouts));
+    header("connections", "gauge", "Open client connections.");
+    out << "chat_connections " << accepts - closes << "\n";
+    header("sessions", "gauge", "Logged-in client connections.");
+    out << "chat_sessions " << logins - logouts << "\n";
+    header("cluster_peers", "gauge", "Peers this node has a link to.");
+    out << "chat_cluster_peers " << peers_connected.load() << "\n";
+    header("unauthenticated", "gauge", "Connections that have not logged in yet.");
+    out << "chat_unauthenticated " << unauthenticated.load() << "\n";
+    header("memory_bytes", "gauge", "Pooled memory in use, by use.");
+    for (int use = 0; use < MEM_USES; ++use) {
+        out << "chat_memory_bytes{use=\"" << memory_names[use] << "\"} "
+            << total([&](const Metrics& m) -> const auto& { return m.memory_bytes[use]; }) << "\n";
+    }
+    header("pool_reserved_bytes", "gauge", "Memory the pools have taken from the heap, by pool.");
+    out << "chat_pool_reserved_bytes{pool=\"connections\"} " << total(FIELD(slab_reserved)) << "\n";
+    out << "chat_pool_reserved_bytes{pool=\"buffers\"} " << total(FIELD(pool_reserved)) << "\n";
+    header("connection_memory_bytes", "gauge", "Average memory per open connection: its slot plus its input and output buffers.");
+    out << "chat_connection_memory_bytes " << connection_memory_locked() << "\n";
+    counter("accepts_total", "Accepted connections.", FIELD(accepts));
+    counter("closes_total", "Closed connections.", FIELD(closes));
+    counter("auth_ok_total", "Successful logins.", FIELD(auth_ok));
+    counter("auth_failed_total", "Logins rejected for a bad username or password.", FIELD(auth_failed));
+    counter("auth_duplicate_total", "Logins rejected because the session limit was reached.", FIELD(auth_duplicate));
+    counter("auth_busy_total", "Logins turned away because the auth queue was full.", FIELD(auth_busy));
+    counter("login_timeouts_total", "Connections closed for not logging in in time.", FIELD(login_timeouts));
+    counter("login_rejected_total", "Connections refused because too many were logging in.", FIELD(login_rejected));
+    counter("logouts_total", "Logged-in connections that closed.", FIELD(logouts));
+    counter("bytes_received_total", "Bytes read from clients.", FIELD(bytes_received));
+    counter("write_calls_total", "Write system calls and submitted sends.", FIELD(write_calls));
+    counter("messages_written_total", "Messages fully written to clients.", FIELD(messages_written));
+    counter("bytes_written_total", "Bytes written to clients.", FIELD(bytes_written));
+    counter("dropped_total", "Messages dropped by a full outbound queue.", FIELD(dropped));
+    counter("overflow_disconnects_total", "Clients disconnected for a full outbound queue.", FIELD(overflow_disconnects));
+    counter("sender_pauses_total", "Times a sender was paused for backpressure.", FIELD(sender_pauses));
+    counter("flush_yields_total", "Flushes that used up their quantum and let other connections write first.", FIELD(flush_yields));
+    counter("log_records_total", "Records written to the message log.", FIELD(log_records));
+    counter("log_bytes_total", "Bytes written to the message log.", FIELD(log_bytes));
+    counter("log_syncs_total", "Message log syncs (one per segment per batch).", FIELD(log_syncs));
+    counter("log_replayed_total", "Logged messages delivered to users who were offline.", FIELD(log_replayed));
+    counter("log_segments_retired_total", "Message log segments deleted once no user needed them.", FIELD(log_retired));
+    counter("cluster_frames_sent_total", "Frames queued for peers.", FIELD(cluster_frames_sent));
+    counter("cluster_bytes_sent_total", "Bytes written to peers.", FIELD(cluster_bytes_sent));
+    counter("cluster_frames_received_total", "Frames received from peers.", FIELD(cluster_frames_received));
+    counter("cluster_bytes_received_total", "Bytes received from peers.", FIELD(cluster_bytes_received));
+
+    header("commands_total", "counter", "Commands handled, by command.");
+    for (int kind = 0; kind < CMD_KINDS; ++kind) {
+        out << "chat_commands_total{command=\"" << command_names[kind] << "\"} "
+            << total([&](const Metrics& m) -> const auto& { return m.commands[kind]; }) << "\n";
+    }
+    header("rate_limited_total", "counter", "Commands refused by a rate limit, by command.");
+    for (int kind = 0; kind < CMD_KINDS; ++kind) {
+        out << "chat_rate_limited_total{command=\"" << command_names[kind] << "\"} "
+            << total([&](const Metrics& m) -> const auto& { return m.rate_limited[kind]; }) << "\n";
+    }
+    header("lock_acquisitions_total", "counter", "Lock acquisitions, by lock class.");
+    for (int lock_class = 0; lock_class < LOCK_CLASSES; ++lock_class) {
+        out << "chat_lock_acquisitions_total{lock=\"" << lock_names[lock_class] << "\"} "
+            << total([&](const Metrics& m) -> const auto& { return m.lock_acquisitions[lock_class]; }) << "\n";
+    }
+    header("lock_contended_total", "counter", "Lock acquisitions that had to wait, by lock class.");
+    for (int lock_class = 0; lock_class < LOCK_CLASSES; ++lock_class) {
+        out << "chat_lock_contended_total{lock=\"" << lock_names[lock_class] << "\"} "
+            << total([&](const Metrics& m) -> const auto& { return m.lock_contended[lock_class]; }) << "\n";
+    }
+
+    header("handoff_seconds", "histogram", "Time from accept until a reactor registers the connection.");
+    histogram("handoff_seconds", "", true, FIELD(handoff_ns));
+    header("auth_seconds", "histogram", "Time from accept until a successful login.");
+    histogram("auth_seconds", "", true, FIELD(auth_ns));
+    header("auth_hash_seconds", "histogram", "Time to verify a hashed password on an auth worker.");
+    histogram("auth_hash_seconds", "", true, FIELD(auth_hash_ns));
+    header("command_seconds", "histogram", "Time to handle a command, by command.");
+    for (int kind = 0; kind < CMD_KINDS; ++kind) {
+        histogram("command_seconds", "command=\"" + string(command_names[kind]) + "\"", true,
+                  [&](const Metrics& m) -> const auto& { return m.command_ns[kind]; });
+    }
+    header("fanout", "histogram", "Recipients per delivered message.");
+    histogram("fanout", "", false, FIELD(fanout));
+    header("queue_depth", "histogram", "Outbound queue length after each enqueue.");
+    histogram("queue_depth", "", false, FIELD(queue_depth));
+    header("lock_wait_seconds", "histogram", "Time spent waiting for a contended lock, by lock class.");
+    for (int lock_class = 0; lock_class < LOCK_CLASSES; ++lock_class) {
+        histogram("lock_wait_seconds", string("lock=\"") + lock_names[lock_class] + "\"", true,
+                  [&](const Metrics& m) -> const auto& { return m.lock_wait_ns[lock_class]; });
+    }
+    header("log_sync_seconds", "histogram", "Time to sync a batch of message log records.");
+    histogram("log_sync_seconds", "", true, FIELD(log_sync_ns));
+#undef FIELD
+    return out.str();
+}
+
+// Serve the metrics over HTTP, one short-lived connection per scrape
+void serve_metrics(int listen_socket) {
+    while (true) {
+        int socket = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket < 0) continue;
+        timeval timeout{1, 0};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        // Read the request headers; the path is ignored
+        string request;
+        char buffer[BUFFER_SIZE];
+        while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos &&
+               request.size() < 8 * BUFFER_SIZE) {
+            ssize_t n = recv(socket, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            request.append(buffer, n);
+        }
+        string body = format_metrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                          to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = send(socket, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(socket);
+    }
+}
+
+// Open the metrics listener: a loopback TCP port, or a unix socket when a path is given
+int create_metrics_listener(int port, const string& path) {
+    int listen_socket;
+    if (!path.empty()) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            cerr << "Error: Metrics socket path too long." << endl;
+            return -1;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_socket < 0 || bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            cerr << "Error: Metrics bind failed." << endl;
+            return -1;
+        }
+    } else {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int opt = 1;
+        listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_socket < 0 || setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            bind(listen_socket, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            cerr << "Error: Metrics bind failed." << endl;
+            return -1;
+        }
+    }
+    if (listen(listen_socket, 16) < 0) {
+        cerr << "Error: Metrics listen failed." << endl;
+        return -1;
     }
-    close(client_socket);
-    broadcast_message(username + " has left the chat.", client_socket);
+    return listen_socket;
 }
 
-int main() {
-    load_users();   // Load users from userts.txt file into the users map
+// Reload the credentials and rate limits whenever SIGHUP arrives. Logins already being verified finish
+// against the table they started with.
+void reload_on_sighup(sigset_t signals) {
+    while (true) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0) continue;
+        if (load_users()) {
+            cout << "Reloaded " << users.load()->size() << " users." << endl;
+        }
+        if (!limits_file.empty() && load_rate_limits()) {
+            cout << "Reloaded rate limits." << endl;
+        }
+    }
+}
+
+// Each connection costs one descriptor, so lift the soft limit to the hard limit.
+void raise_fd_limit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+// Create a bound, listening TCP socket. With reuseport several sockets can share the port
+// and the kernel spreads incoming connections across them.
+int create_listener(int port, bool reuseport, bool nonblocking, int backlog) {
+    int server_socket = socket(AF_INET, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0) | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         cerr << "Error: Socket failed";
-        return 1;
+        return -1;
     }
 
     sockaddr_in server_addr{};
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         cerr << "setsockopt failed";
-        return 1;
+        close(server_socket);
+        return -1;
     }
 
     // Bind the socket to the address
     if (bind(server_socket, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         cerr << "Error: Bind failed."<<endl;
-        return 1;
+        close(server_socket);
+        return -1;
     }
     // Listen for incoming connections
-    if (listen(server_socket, 5) < 0) {
+    if (listen(server_socket, backlog) < 0) {
         cerr << "Error: Listen failed.";
+        close(server_socket);
+        return -1;
+    }
+    return server_socket;
+}
+
+int main(int argc, char* argv[]) {
+    int num_reactors = DEFAULT_REACTORS;
+    int backlog = SOMAXCONN;
+    bool reuseport = false;
+    int stats_interval = 0;
+    int metrics_port = 0;
+    string metrics_path;
+    string log_dir;
+    int auth_workers = DEFAULT_AUTH_WORKERS;
+    string build_input, build_output;
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    int parser_rounds = 0;
+    int cluster_port = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if ((arg == "-r" || arg == "--reactors") && i + 1 < argc) {
+            num_reactors = max(0, atoi(argv[++i]));
+        } else if (arg == "--port" && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (arg == "--node" && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+        } else if (arg == "--cluster-port" && i + 1 < argc) {
+            cluster_port = atoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            string address = argv[++i];
+            size_t colon = address.rfind(':');
+            if (colon == string::npos) {
+                cerr << "Error: --peer needs HOST:PORT" << endl;
+                return 1;
+            }
+            auto peer = make_unique<Peer>();
+            peer->host = address.substr(0, colon);
+            peer->port = address.substr(colon + 1);
+            peers.push_back(std::move(peer));
+        } else if (arg == "--reuseport") {
+            reuseport = true;
+        } else if (arg == "--backlog" && i + 1 < argc) {
+            backlog = max(1, atoi(argv[++i]));
+        } else if (arg == "--presence-window" && i + 1 < argc) {
+            presence_window = max(0, atoi(argv[++i]));
+        } else if (arg == "--limits" && i + 1 < argc) {
+            limits_file = argv[++i];
+        } else if (arg == "--users" && i + 1 < argc) {
+            users_file = argv[++i];
+        } else if (arg == "--credentials" && i + 1 < argc) {
+            credentials_file = argv[++i];
+        } else if (arg == "--auth-workers" && i + 1 < argc) {
+            auth_workers = max(1, atoi(argv[++i]));
+        } else if (arg == "--build-credentials" && i + 2 < argc) {
+            build_input = argv[++i];
+            build_output = argv[++i];
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = max(1, atoi(argv[++i]));
+        } else if (arg == "--bench-parser") {
+            parser_rounds = i + 1 < argc && isdigit(argv[i + 1][0]) ? max(1, atoi(argv[++i])) : 200000;
+        } else if (arg == "--login-timeout" && i + 1 < argc) {
+            login_timeout = max(1, atoi(argv[++i]));
+        } else if (arg == "--max-unauthenticated" && i + 1 < argc) {
+            max_unauthenticated = max(1, atoi(argv[++i]));
+        } else if (arg == "--sessions" && i + 1 < argc) {
+            max_sessions = max(1, atoi(argv[++i]));
+        } else if (arg == "--outq" && i + 1 < argc) {
+            max_outq = max(1, atoi(argv[++i]));
+        } else if (arg == "--overflow" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "drop") overflow_policy = OVERFLOW_DROP;
+            else if (policy == "disconnect") overflow_policy = OVERFLOW_DISCONNECT;
+            else if (policy == "backpressure") overflow_policy = OVERFLOW_BACKPRESSURE;
+            else {
+                cerr << "Error: Unknown overflow policy " << policy << endl;
+                return 1;
+            }
+        } else if (arg == "--io-uring") {
+            uring_enabled = true;
+        } else if (arg == "--zerocopy") {
+            zerocopy_enabled = true;
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_interval = max(0, atoi(argv[++i]));
+        } else if (arg == "--log-dir" && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            metrics_port = max(0, atoi(argv[++i]));
+        } else if (arg == "--metrics-socket" && i + 1 < argc) {
+            metrics_path = argv[++i];
+        } else {
+            cerr << "Usage: " << argv[0] << " [--port N] [--reactors N] [--reuseport] [--backlog N] [--users FILE | --credentials FILE] [--auth-workers N] [--login-timeout SECONDS] [--max-unauthenticated N] [--sessions N] [--limits FILE] [--presence-window MS] [--outq N] [--overflow drop|disconnect|backpressure] [--io-uring] [--zerocopy] [--log-dir DIR] [--stats SECONDS] [--metrics-port N] [--metrics-socket PATH] [--node ID --cluster-port N --peer HOST:PORT ...]" << endl;
+            cerr << "       " << argv[0] << " --build-credentials USERS_FILE INDEX_FILE [--iterations N]" << endl;
+            cerr << "       " << argv[0] << " --bench-parser [ROUNDS]" << endl;
+            return 1;
+        }
+    }
+
+    if (!build_input.empty()) {
+        return build_credentials(build_input, build_output, iterations) ? 0 : 1;
+    }
+    if (parser_rounds) {
+        return bench_parser(parser_rounds);
+    }
+    if ((cluster_port || !peers.empty()) && (node_id < 0 || node_id > 0xffff || !cluster_port)) {
+        cerr << "Error: Cluster mode needs --node ID (0-65535) and --cluster-port N" << endl;
+        return 1;
+    }
+
+    // SIGHUP reloads the credentials; block it before any thread starts so only
+    // reload_on_sighup receives it
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
+
+    if (!load_users()) {   // Load users from users.txt, or the credential index
+        return 1;
+    }
+    if (!limits_file.empty() && !load_rate_limits()) {
         return 1;
     }
+    thread(reload_on_sighup, reload_signals).detach();
+    if (users.load()->hashed()) {
+        for (int i = 0; i < auth_workers; ++i) {
+            thread(auth_worker).detach();
+        }
+    }
+    raise_fd_limit();
+
+    if (!log_dir.empty()) {
+        message_log = make_unique<MessageLog>(log_dir);
+        if (!message_log->recover()) {
+            return 1;
+        }
+        // Groups outlive their connected members while someone still belongs to them
+        for (auto& group : message_log->memberships()) {
+            groups.modify(group.first, true, [&](uint32_t, Group& restored, bool) {
+                restored.members = std::move(group.second);
+                return GROUP_OK;
+            });
+        }
+        thread([] { message_log->run(); }).detach();
+    }
+
+    if (num_reactors == 0) {
+        num_reactors = max(1u, thread::hardware_concurrency());
+    }
+
+    // Set up all rings first; if io_uring is unavailable every reactor uses epoll
+    vector<unique_ptr<Uring>> rings;
+    for (int i = 0; uring_enabled && i < num_reactors; ++i) {
+        auto ring = make_unique<Uring>();
+        if (ring->setup()) {
+            rings.push_back(std::move(ring));
+        } else {
+            cerr << "io_uring unavailable (" << strerror(errno) << "), falling back to epoll" << endl;
+            uring_enabled = false;
+            rings.clear();
+        }
+    }
+
+    // Either one shared listener or one listener per reactor. The shared one is served by
+    // this thread with epoll, and by every reactor's multishot accept with io_uring.
+    int server_socket = -1;
+    if (!reuseport && (server_socket = create_listener(server_port, false, false, backlog)) < 0) {
+        return 1;
+    }
+
+    // Start the reactor threads
+    for (int i = 0; i < num_reactors; ++i) {
+        auto reactor = make_unique<Reactor>();
+        reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (reactor->epoll_fd < 0 || reactor->wake_fd < 0 || reactor->timer_fd < 0) {
+            cerr << "Error: Reactor setup failed." << endl;
+            return 1;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = reactor->wake_fd;
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &ev);
+        ev.data.fd = reactor->timer_fd;
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &ev);
+        if (reuseport) {
+            if ((reactor->listen_fd = create_listener(server_port, true, !uring_enabled, backlog)) < 0) {
+                return 1;
+            }
+        } else if (uring_enabled) {
+            reactor->listen_fd = server_socket;
+        }
+        if (uring_enabled) {
+            reactor->uring = std::move(rings[i]);
+        } else if (reactor->listen_fd >= 0) {
+            ev.data.fd = reactor->listen_fd;
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev);
+        }
+        reactors.push_back(std::move(reactor));
+    }
+    for (auto& reactor : reactors) {
+        thread(reactor->uring ? uring_loop : reactor_loop, ref(*reactor)).detach();
+    }
+    if (stats_interval > 0) {
+        thread(report_stats, stats_interval).detach();
+    }
+    if (presence_window > 0) {
+        thread(flush_presence).detach();
+    }
+    if (cluster_port) {
+        int cluster_socket = create_listener(cluster_port, false, false, SOMAXCONN);
+        if (cluster_socket < 0) {
+            return 1;
+        }
+        thread(accept_peers, cluster_socket).detach();
+        for (auto& peer : peers) {
+            thread(run_peer, ref(*peer)).detach();
+        }
+    }
+    if (metrics_port > 0 || !metrics_path.empty()) {
+        int metrics_socket = create_metrics_listener(metrics_port, metrics_path);
+        if (metrics_socket < 0) {
+            return 1;
+        }
+        thread(serve_metrics, metrics_socket).detach();
+    }
+
+    cout << "Server listening on port " << server_port << " with " << num_reactors << " reactors"
+         << (reuseport ? " (SO_REUSEPORT)" : "") << (uring_enabled ? " on io_uring" : "") << "...." << endl;
 
-    cout << "Server listening on port " << PORT << "...." << endl;
+    if (reuseport || uring_enabled) {
+        while (true) {
+            pause();  // The reactors accept for themselves
+        }
+    }
 
+    size_t next_reactor = 0;
     while (true) {
         sockaddr_in client_addr{};
         socklen_t addr_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (sockaddr*)&client_addr, &addr_len);
+        int client_socket = accept4(server_socket, (sockaddr*)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (client_socket < 0) {
-            cerr << "Error: Accept failed.";
+            if (errno != EINTR) cerr << "Error: Accept failed." << endl;
             continue;
         }
 
-        thread t(handle_client, client_socket);
-        t.detach();
+        // Hand the socket to the reactors in round-robin order
+        bump(metrics().accepts);
+        post_to_reactor(*reactors[next_reactor++ % reactors.size()], &Reactor::pending_sockets,
+                        Accepted{client_socket, now_ns()});
     }
 
     close(server_socket);
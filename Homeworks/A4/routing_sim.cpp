@@ -2,186 +2,994 @@
 #include <vector>
 #include <limits>
 #include <queue>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <charconv>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
-const int INF = 9999; // A constant to represent infinity
+const int INF = 9999; // Marks a missing link in the matrix format; printed for unreachable destinations
+const int UNREACHABLE = numeric_limits<int>::max(); // Distance to a node with no path
+
+// Directed graph in compressed sparse row (CSR) form: the links out of node u are
+// target[offset[u]] .. target[offset[u + 1] - 1], with their costs at the same positions.
+struct Graph {
+    int n = 0;
+    vector<int> offset;  // n + 1 entries
+    vector<int> target;
+    vector<int> cost;
+};
+
+int numThreads = 1; // Threads the route computations are split across (--threads)
+
+// Distance as printed in the tables
+int shownCost(int d) {
+    return d == UNREACHABLE ? INF : d;
+}
+
+// Run body(begin, end, worker) over the range [0, count) on up to numThreads threads.
+// Workers take chunks from a shared counter, so a thread that finishes early takes more
+// work; worker is the thread's index, for its own scratch buffers.
+void parallelFor(int count, int chunk, const function<void(int, int, int)>& body) {
+    int workers = min(numThreads, (count + chunk - 1) / chunk);
+    if (workers <= 1) {
+        if (count > 0) body(0, count, 0);
+        return;
+    }
+    atomic<int> next(0);
+    auto run = [&](int worker) {
+        for (int begin; (begin = next.fetch_add(chunk)) < count;) {
+            body(begin, min(begin + chunk, count), worker);
+        }
+    };
+    vector<thread> pool;
+    for (int worker = 1; worker < workers; ++worker) pool.emplace_back(run, worker);
+    run(0);
+    for (thread& t : pool) t.join();
+}
+
+// Hash of one routing table, for checking that runs agree without printing them
+uint64_t tableChecksum(const vector<int>& dist, const vector<int>& hop) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < dist.size(); ++i) {
+        hash = (hash ^ (uint32_t)dist[i]) * 1099511628211ull;
+        hash = (hash ^ (uint32_t)hop[i]) * 1099511628211ull;
+    }
+    return hash;
+}
 
 // Print the Distance Vector Routing table for a node
 void printDVRTable(int node, const vector<vector<int>>& table, const vector<vector<int>>& nextHop) {
     cout << "Node " << node << " Routing Table:\n";
     cout << "Dest\tCost\tNext Hop\n";
     for (int i = 0; i < table.size(); ++i) {
-        cout << i << "\t" << table[node][i] << "\t";
+        cout << i << "\t" << shownCost(table[node][i]) << "\t";
         if (nextHop[node][i] == -1) cout << "-";
         else cout << nextHop[node][i];
-        cout << endl;
+        cout << "\n";
     }
     cout << endl;
 }
 
-// Simulate the Distance Vector Routing (DVR) algorithm
-void simulateDVR(const vector<vector<int>>& graph) {
-    int n = graph.size();
-    vector<vector<int>> dist = graph; // Distance matrix
-    vector<vector<int>> nextHop(n, vector<int>(n)); // Next hop matrix
-
-    // Initialize distance and next hop
+// Initial DVR tables: 0 to self, the link cost to direct neighbors, unreachable otherwise
+void initDVRTables(const Graph& graph, vector<vector<int>>& dist, vector<vector<int>>& nextHop) {
+    int n = graph.n;
+    dist.assign(n, vector<int>(n, UNREACHABLE));
+    nextHop.assign(n, vector<int>(n, -1)); // -1: no next hop, or self
     for (int u = 0; u < n; ++u) {
-        for (int v = 0; v < n; ++v) {
-            if (u == v) {
-                dist[u][v] = 0;
-                nextHop[u][v] = -1; // No next hop for self
-            } else if (dist[u][v] != INF) {
+        dist[u][u] = 0;
+        for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+            int v = graph.target[e];
+            if (graph.cost[e] < dist[u][v]) {
+                dist[u][v] = graph.cost[e];
                 nextHop[u][v] = v; // Directly connected neighbor
-            } else {
-                nextHop[u][v] = -1; // No valid next hop
             }
         }
     }
+}
+
+// Simulate the Distance Vector Routing (DVR) algorithm in synchronous rounds: in every
+// iteration each node advertises its whole vector to its neighbors, which all update at once.
+// Every iteration splits the nodes across the threads; each node only writes its own row.
+// Returns a checksum of the final tables; with print false nothing is printed.
+uint64_t simulateDVR(const Graph& graph, bool print = true) {
+    int n = graph.n;
+    vector<vector<int>> dist, nextHop; // Distance and next hop matrices
+    initDVRTables(graph, dist, nextHop);
 
     // Print initial tables
-    cout << "--- Initial DVR Tables ---\n";
-    for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+    if (print) {
+        cout << "--- Initial DVR Tables ---\n";
+        for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+    }
 
     // Distance Vector algorithm loop until no updates (convergence)
-    bool updated;
+    atomic<bool> updated;
     int iteration = 0;
+    long long rounds = 0;
+    vector<vector<int>> newDist(n), newNext(n);
     do {
         updated = false; // Flag to check if any distance is updated in this iteration
-
-        // Create temporary copies of current distance and nextHop tables
-        vector<vector<int>> newDist = dist;
-        vector<vector<int>> newNext = nextHop;
+        rounds++;
 
         // Iterate over each node u
-        for (int u = 0; u < n; ++u) {
-            // Check neighbors v of node u
-            for (int v = 0; v < n; ++v) {
-                if (dist[u][v] == INF || u == v) continue; // Skip if v is not a neighbor or same node
-
-                // Try to reach every destination 'dest' via neighbor v
-                for (int dest = 0; dest < n; ++dest) {
-                    if (dist[v][dest] == INF) continue; // Skip if v cannot reach dest
-
-                    // Calculate alternative distance to 'dest' via 'v'
-                    int alt = dist[u][v] + dist[v][dest];
-
-                    // If the alternative path is shorter, update new distance and next hop
-                    if (alt < newDist[u][dest]) {
-                        newDist[u][dest] = alt;
-                        newNext[u][dest] = nextHop[u][v]; // Set next hop from u to dest via v
-                        updated = true; // Mark that an update occurred
+        parallelFor(n, 64, [&](int begin, int end, int) {
+            bool changed = false;
+            for (int u = begin; u < end; ++u) {
+                // Start from a copy of u's current row (the buffers are reused across iterations)
+                newDist[u] = dist[u];
+                newNext[u] = nextHop[u];
+
+                // Check the neighbors v of node u: D(u, dest) = min over v of cost(u, v) + D(v, dest)
+                for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+                    int v = graph.target[e];
+
+                    // Try to reach every destination 'dest' via neighbor v
+                    for (int dest = 0; dest < n; ++dest) {
+                        if (dist[v][dest] == UNREACHABLE) continue; // Skip if v cannot reach dest
+
+                        // Calculate alternative distance to 'dest' via 'v'
+                        int alt = graph.cost[e] + dist[v][dest];
+
+                        // If the alternative path is shorter, update new distance and next hop
+                        if (alt < newDist[u][dest]) {
+                            newDist[u][dest] = alt;
+                            newNext[u][dest] = v; // Set next hop from u to dest via v
+                            changed = true; // Mark that an update occurred
+                        }
                     }
                 }
             }
-        }
+            if (changed) updated = true;
+        });
 
         // If there were updates, apply them and print updated tables
         if (updated) {
             iteration++;
             dist.swap(newDist);
             nextHop.swap(newNext);
-            cout << "--- DVR Tables after iteration " << iteration << " ---\n";
-            for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+            if (print) {
+                cout << "--- DVR Tables after iteration " << iteration << " ---\n";
+                for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+            }
         }
     } while (updated);
 
-    cout << "--- DVR Final Tables ---\n";
-    for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+    uint64_t checksum = 0;
+    for (int u = 0; u < n; ++u) checksum += tableChecksum(dist[u], nextHop[u]);
+    if (print) {
+        cout << "--- DVR Final Tables ---\n";
+        for (int i = 0; i < n; ++i) printDVRTable(i, dist, nextHop);
+        // Every round, the last one included, sends each node's full vector over every link
+        cout << "DVR converged after " << iteration << " iterations: " << rounds * graph.target.size()
+             << " messages, " << rounds * graph.target.size() * n << " entries\n";
+    }
+    return checksum;
+}
+
+// Links into each node, for sending a node's advertisements to the nodes that route through it
+struct ReverseGraph {
+    vector<int> offset; // n + 1 entries
+    vector<int> source;
+    vector<int> cost;
+};
+
+ReverseGraph reverseGraph(const Graph& graph) {
+    ReverseGraph reverse;
+    reverse.offset.assign(graph.n + 1, 0);
+    for (int v : graph.target) reverse.offset[v + 1]++;
+    for (int v = 0; v < graph.n; ++v) reverse.offset[v + 1] += reverse.offset[v];
+    reverse.source.resize(graph.target.size());
+    reverse.cost.resize(graph.target.size());
+    vector<int> next(reverse.offset.begin(), reverse.offset.end() - 1);
+    for (int u = 0; u < graph.n; ++u) {
+        for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+            int slot = next[graph.target[e]]++;
+            reverse.source[slot] = u;
+            reverse.cost[slot] = graph.cost[e];
+        }
+    }
+    return reverse;
+}
+
+// Bring the reverse links up to date after setLink changed the link u->v: rebuild them if
+// it rebuilt the CSR arrays, or else patch the new cost in place
+void updateReverse(const Graph& graph, ReverseGraph& reverse, int u, int v, bool rebuilt) {
+    if (rebuilt) {
+        reverse = reverseGraph(graph);
+        return;
+    }
+    for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+        if (graph.target[e] != v) continue;
+        for (int slot = reverse.offset[v]; slot < reverse.offset[v + 1]; ++slot) {
+            if (reverse.source[slot] == u) reverse.cost[slot] = graph.cost[e];
+        }
+    }
+}
+
+// Event-driven DVR: routers act on messages instead of in lockstep rounds. A node whose
+// vector changed is put on a worklist together with the destinations that changed; when it
+// is taken off, it advertises only those entries, and only to the nodes that have a link to
+// it. A receiver that improves (or whose next hop reports a new cost) joins the worklist in
+// turn. The work is proportional to the changes rather than to n^2 per round.
+//
+// Advertisements use poisoned reverse: a node tells its next hop for dest that it cannot
+// reach dest, so two nodes never route through each other. Longer loops can still count to
+// infinity after a failure. Routes therefore also carry their hop count, as in RIP: a simple
+// path has at most n - 1 hops, so a route with more is declared unreachable instead.
+struct AsyncDVR {
+    const Graph& graph;
+    ReverseGraph reverse;
+    vector<vector<int>> dist, nextHop;
+    vector<vector<int>> hops;           // Links on each route
+    vector<vector<int>> changed;        // Destinations each node has yet to advertise
+    vector<vector<char>> isChanged;     // Whether a destination is in the node's changed list
+    deque<int> worklist;                // Nodes with changes to advertise, in FIFO order
+    vector<char> queued;
+    vector<int> delay;                  // Message delays from the start until a queued node's update
+    vector<char> touched;               // Nodes whose table changed since the counters were reset
+    bool poisonedReverse = true;
+    int current = -1;                   // Delay of the node being processed (-1: none)
+    long long activations = 0, messages = 0, entries = 0, countedToInfinity = 0;
+    int lastChange = 0;                 // Delay of the last route change
+
+    explicit AsyncDVR(const Graph& g, bool poison = true)
+        : graph(g), reverse(reverseGraph(g)), poisonedReverse(poison) {
+        initDVRTables(graph, dist, nextHop);
+        hops.assign(graph.n, vector<int>(graph.n, 0));
+        for (int u = 0; u < graph.n; ++u) {
+            for (int d = 0; d < graph.n; ++d) {
+                if (nextHop[u][d] != -1) hops[u][d] = 1;
+            }
+        }
+        changed.resize(graph.n);
+        isChanged.assign(graph.n, vector<char>(graph.n, 0));
+        queued.assign(graph.n, 0);
+        delay.assign(graph.n, 0);
+        touched.assign(graph.n, 0);
+        // At the start every node advertises what it knows: itself and its direct neighbors
+        for (int u = 0; u < graph.n; ++u) {
+            for (int d = 0; d < graph.n; ++d) {
+                if (dist[u][d] != UNREACHABLE) markChanged(u, d);
+            }
+        }
+    }
+
+    void markChanged(int u, int dest) {
+        if (!isChanged[u][dest]) {
+            isChanged[u][dest] = 1;
+            changed[u].push_back(dest);
+        }
+        // u sends once it has heard everything that changed it
+        delay[u] = queued[u] ? max(delay[u], current + 1) : current + 1;
+        lastChange = max(lastChange, delay[u]);
+        touched[u] = 1;
+        if (!queued[u]) {
+            queued[u] = 1;
+            worklist.push_back(u);
+        }
+    }
+
+    // The cost to dest that v advertises to its neighbor w
+    int advertised(int v, int w, int dest) const {
+        return poisonedReverse && nextHop[v][dest] == w ? UNREACHABLE : dist[v][dest];
+    }
+
+    // Route cost to dest via v, advertised over a link of the given cost, if it is within
+    // the hop limit. Sets overLimit if v's route is dropped for having too many hops.
+    long long routeVia(int v, int w, int cost, int dest, bool& overLimit) const {
+        int offer = advertised(v, w, dest);
+        if (offer == UNREACHABLE) return UNREACHABLE;
+        if (hops[v][dest] + 1 > graph.n - 1) {
+            overLimit = true;
+            return UNREACHABLE;
+        }
+        return (long long)cost + offer;
+    }
+
+    // Install a new route and advertise it if its cost or next hop changed. A new hop count
+    // alone is not advertised: a route that loops keeps getting dearer, so its count still
+    // travels with every step of the loop.
+    void setRoute(int w, int dest, int cost, int hop) {
+        hops[w][dest] = hop == -1 ? 0 : hops[hop][dest] + 1;
+        if (cost != dist[w][dest] || hop != nextHop[w][dest]) {
+            dist[w][dest] = cost;
+            nextHop[w][dest] = hop;
+            markChanged(w, dest);
+        }
+    }
+
+    // Best route from w to dest over all of w's links, from its neighbors' current vectors
+    void recompute(int w, int dest) {
+        long long best = UNREACHABLE;
+        int hop = -1;
+        bool overLimit = false;
+        for (int e = graph.offset[w]; e < graph.offset[w + 1]; ++e) {
+            int v = graph.target[e];
+            long long alt = routeVia(v, w, graph.cost[e], dest, overLimit);
+            if (alt < best) {
+                best = alt;
+                hop = v;
+            }
+        }
+        if (best == UNREACHABLE && overLimit && dist[w][dest] != UNREACHABLE) countedToInfinity++;
+        setRoute(w, dest, best, hop);
+    }
+
+    // w hears from neighbor u, over a link of the given cost, that u's route to dest changed
+    void receive(int w, int u, int cost, int dest) {
+        if (dest == w) return;
+        if (nextHop[w][dest] == u) {
+            // The route w uses changed, better or worse: find the best route again
+            recompute(w, dest);
+            return;
+        }
+        bool overLimit = false;
+        long long alt = routeVia(u, w, cost, dest, overLimit);
+        if (alt < dist[w][dest]) setRoute(w, dest, alt, u);
+    }
+
+    // setLink changed the link u->v from oldCost to newCost (UNREACHABLE: no link). u notices
+    // locally: routes through v are recomputed and v's routes are tried over the new cost.
+    // Call run() to propagate the result.
+    void linkChanged(int u, int v, int oldCost, int newCost, bool rebuilt) {
+        updateReverse(graph, reverse, u, v, rebuilt);
+        if (oldCost == newCost) return;
+        for (int dest = 0; dest < graph.n; ++dest) {
+            if (dest == u) continue;
+            if (nextHop[u][dest] == v) {
+                recompute(u, dest);
+            } else if (newCost != UNREACHABLE) {
+                bool overLimit = false;
+                long long alt = routeVia(v, u, newCost, dest, overLimit);
+                if (alt < dist[u][dest]) setRoute(u, dest, alt, v);
+            }
+        }
+    }
+
+    // Start counting the work of a new event
+    void resetCounters() {
+        activations = messages = entries = countedToInfinity = 0;
+        lastChange = 0;
+        touched.assign(graph.n, 0);
+    }
+
+    // Process the worklist until no node has anything left to advertise
+    void run() {
+        vector<int> batch;
+        while (!worklist.empty()) {
+            int u = worklist.front();
+            worklist.pop_front();
+            queued[u] = 0;
+            current = delay[u];
+            batch.swap(changed[u]);
+            changed[u].clear();
+            for (int dest : batch) isChanged[u][dest] = 0;
+            activations++;
+            for (int e = reverse.offset[u]; e < reverse.offset[u + 1]; ++e) {
+                messages++;
+                entries += batch.size();
+                for (int dest : batch) receive(reverse.source[e], u, reverse.cost[e], dest);
+            }
+        }
+        current = -1;
+    }
+};
+
+// Simulate DVR with the event-driven engine. Returns a checksum of the final tables.
+uint64_t simulateAsyncDVR(AsyncDVR& dvr, bool print = true) {
+    int n = dvr.graph.n;
+    if (print) {
+        cout << "--- Initial DVR Tables ---\n";
+        for (int i = 0; i < n; ++i) printDVRTable(i, dvr.dist, dvr.nextHop);
+    }
+    dvr.run();
+    uint64_t checksum = 0;
+    for (int u = 0; u < n; ++u) checksum += tableChecksum(dvr.dist[u], dvr.nextHop[u]);
+    if (print) {
+        cout << "--- DVR Final Tables ---\n";
+        for (int i = 0; i < n; ++i) printDVRTable(i, dvr.dist, dvr.nextHop);
+        cout << "DVR converged after " << dvr.activations << " node updates: " << dvr.messages << " messages, "
+             << dvr.entries << " entries, " << dvr.lastChange << " message delays\n";
+    }
+    return checksum;
 }
 
 // Print the Link State Routing (LSR) table for a node
-void printLSRTable(int src, const vector<int>& dist, const vector<int>& prev) {
-    cout << "Node " << src << " Routing Table:\n";
-    cout << "Dest\tCost\tNext Hop\n";
+void printLSRTable(int src, const vector<int>& dist, const vector<int>& firstHop, ostream& out = cout) {
+    out << "Node " << src << " Routing Table:\n";
+    out << "Dest\tCost\tNext Hop\n";
     for (int i = 0; i < dist.size(); ++i) {
         if (i == src) continue;
-        cout << i << "\t" << dist[i] << "\t";
+        out << i << "\t" << shownCost(dist[i]) << "\t" << firstHop[i] << "\n";
+    }
+    out << endl;
+}
+
+// Dijkstra's algorithm from src with a binary heap of (distance, node) over the CSR links,
+// in O(E log V). Equal distances are settled in node order, like a linear scan for the
+// closest node would. firstHop[v] is the neighbor of src that the path to v starts with
+// (-1 if v is unreachable); it is recorded whenever v's distance improves, so no path has
+// to be traced afterwards. If parent is given, it receives the shortest-path tree. The
+// vectors are reused across sources.
+void dijkstra(const Graph& graph, int src, vector<int>& dist, vector<int>& firstHop, vector<pair<int, int>>& heap,
+              vector<int>* parent = nullptr) {
+    dist.assign(graph.n, UNREACHABLE);
+    firstHop.assign(graph.n, -1);
+    if (parent) parent->assign(graph.n, -1);
+    heap.clear();
+    dist[src] = 0;
+    heap.emplace_back(0, src);
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+        int d = heap.back().first, u = heap.back().second;
+        heap.pop_back();
+        if (d != dist[u]) continue; // Stale entry: u was reached more cheaply since
 
-        // Reconstruct the path to determine the next hop
-        int hop = i;
-        while (prev[hop] != src && prev[hop] != -1)
-            hop = prev[hop];
-        cout << (prev[hop] == -1 ? -1 : hop) << endl;
+        // Update distances to neighbors
+        for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+            int v = graph.target[e];
+            int alt = d + graph.cost[e];
+            if (alt < dist[v]) {
+                dist[v] = alt;
+                firstHop[v] = u == src ? v : firstHop[u];
+                if (parent) (*parent)[v] = u;
+                heap.emplace_back(alt, v);
+                push_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+            }
+        }
     }
-    cout << endl;
 }
 
-// Simulate the Link State Routing (LSR) algorithm using Dijkstra’s algorithm
-void simulateLSR(const vector<vector<int>>& graph) {
-    int n = graph.size();
-    for (int src = 0; src < n; ++src) {
-        vector<int> dist(n, INF); // Distance from source to each node
-        vector<int> prev(n, -1); // Predecessor node in the path
-        vector<bool> visited(n, false); // Visited nodes
-        dist[src] = 0;
-        
-         // Dijkstra’s algorithm
-         for (int iter = 0; iter < n; ++iter) {
-            int u = -1, best = INF + 1;
-            // Find unvisited node with smallest distance
-            for (int i = 0; i < n; ++i) {
-                if (!visited[i] && dist[i] < best) {
-                    best = dist[i]; u = i;
+// Per-thread buffers of one Dijkstra run
+struct DijkstraScratch {
+    vector<int> dist, firstHop;
+    vector<pair<int, int>> heap;
+};
+
+// Simulate the Link State Routing (LSR) algorithm using Dijkstra’s algorithm. The sources are
+// split across the threads in blocks; each block's tables are formatted in parallel and then
+// printed in source order, so the output does not depend on the thread count. Returns a
+// checksum of all tables; with print false nothing is printed.
+uint64_t simulateLSR(const Graph& graph, bool print = true) {
+    vector<DijkstraScratch> scratch(numThreads);
+    int block = print ? numThreads * 64 : max(graph.n, 1); // Tables held before they are printed
+    vector<string> tables(print ? block : 0);
+    atomic<uint64_t> checksum(0);
+    for (int first = 0; first < graph.n; first += block) {
+        int count = min(block, graph.n - first);
+        parallelFor(count, 16, [&](int begin, int end, int worker) {
+            DijkstraScratch& s = scratch[worker];
+            uint64_t sum = 0;
+            for (int i = begin; i < end; ++i) {
+                dijkstra(graph, first + i, s.dist, s.firstHop, s.heap);
+                sum += tableChecksum(s.dist, s.firstHop);
+                if (print) {
+                    ostringstream out;
+                    printLSRTable(first + i, s.dist, s.firstHop, out); // LSR table for the source node
+                    tables[i] = out.str();
                 }
             }
-            if (u == -1) break;
-            visited[u] = true;
+            checksum += sum;
+        });
+        for (int i = 0; print && i < count; ++i) cout << tables[i];
+    }
+    return checksum;
+}
 
-            // Update distances to neighbors
-            for (int v = 0; v < n; ++v) {
-                if (graph[u][v] != INF && !visited[v]) {
-                    int alt = dist[u] + graph[u][v];
-                    if (alt < dist[v]) {
-                        dist[v] = alt;
-                        prev[v] = u;
-                    }
+// Per-thread buffers of the shortest-path tree repairs
+struct RepairScratch {
+    vector<pair<int, int>> heap;
+    vector<int> childOffset, children, cursor, subtree;
+    vector<char> inSubtree;
+    long long settled = 0;
+};
+
+// LSR that keeps every source's shortest-path tree and repairs it when a link changes,
+// instead of rerunning Dijkstra:
+// - a link that got cheaper (or came up) can only shorten paths through it, so Dijkstra is
+//   restarted from its far end and stops wherever nothing improves;
+// - a tree link that got dearer (or went down) only affects the subtree below it. Those
+//   nodes are reset, seeded with their best link from outside the subtree, and settled again.
+// Other trees are left alone. The sources are split across the threads.
+struct DynamicLSR {
+    const Graph& graph;
+    ReverseGraph reverse;
+    vector<vector<int>> dist, parent, firstHop;
+    vector<RepairScratch> scratch;
+    vector<char> repairedTree;          // Sources whose tree was repaired since the counters were reset
+    long long settled = 0;              // Nodes settled again since the counters were reset
+
+    explicit DynamicLSR(const Graph& g)
+        : graph(g), reverse(reverseGraph(g)), dist(g.n), parent(g.n), firstHop(g.n), scratch(numThreads),
+          repairedTree(g.n, 0) {
+        parallelFor(graph.n, 16, [&](int begin, int end, int worker) {
+            for (int s = begin; s < end; ++s) dijkstra(graph, s, dist[s], firstHop[s], scratch[worker].heap, &parent[s]);
+        });
+    }
+
+    // Settle the nodes on the heap and everything they improve, as in dijkstra()
+    void settle(int src, RepairScratch& r) {
+        vector<int>& d = dist[src];
+        vector<pair<int, int>>& heap = r.heap;
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
+            int du = heap.back().first, u = heap.back().second;
+            heap.pop_back();
+            if (du != d[u]) continue;
+            r.settled++;
+            for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+                int v = graph.target[e];
+                int alt = du + graph.cost[e];
+                if (alt < d[v]) {
+                    d[v] = alt;
+                    parent[src][v] = u;
+                    firstHop[src][v] = u == src ? v : firstHop[src][u];
+                    heap.emplace_back(alt, v);
+                    push_heap(heap.begin(), heap.end(), greater<pair<int, int>>());
                 }
             }
         }
+    }
+
+    // Repair src's tree after the link u->v went from oldCost to newCost. Returns false if
+    // the tree is not affected.
+    bool repair(int src, int u, int v, int oldCost, int newCost, RepairScratch& r) {
+        vector<int>& d = dist[src];
+        vector<int>& p = parent[src];
+        vector<int>& hop = firstHop[src];
+        r.heap.clear();
+        if (newCost < oldCost) {
+            if (d[u] == UNREACHABLE || (long long)d[u] + newCost >= d[v]) return false;
+            d[v] = d[u] + newCost;
+            p[v] = u;
+            hop[v] = u == src ? v : hop[u];
+            r.heap.emplace_back(d[v], v);
+            settle(src, r);
+            return true;
+        }
+        if (p[v] != u || d[v] != d[u] + oldCost) return false; // Not a tree link
+
+        // Collect v's subtree from the children lists of the tree
+        int n = graph.n;
+        r.childOffset.assign(n + 1, 0);
+        for (int x = 0; x < n; ++x) {
+            if (p[x] >= 0) r.childOffset[p[x] + 1]++;
+        }
+        for (int x = 0; x < n; ++x) r.childOffset[x + 1] += r.childOffset[x];
+        r.children.resize(n);
+        r.cursor.assign(r.childOffset.begin(), r.childOffset.end() - 1);
+        for (int x = 0; x < n; ++x) {
+            if (p[x] >= 0) r.children[r.cursor[p[x]]++] = x;
+        }
+        r.inSubtree.assign(n, 0);
+        r.subtree.assign(1, v);
+        r.inSubtree[v] = 1;
+        for (size_t i = 0; i < r.subtree.size(); ++i) {
+            int x = r.subtree[i];
+            for (int c = r.childOffset[x]; c < r.childOffset[x + 1]; ++c) {
+                r.inSubtree[r.children[c]] = 1;
+                r.subtree.push_back(r.children[c]);
+            }
+        }
+        for (int x : r.subtree) {
+            d[x] = UNREACHABLE;
+            p[x] = -1;
+            hop[x] = -1;
+        }
+
+        // Every path into the subtree enters it over a link from a node whose tree is intact
+        for (int x : r.subtree) {
+            for (int e = reverse.offset[x]; e < reverse.offset[x + 1]; ++e) {
+                int y = reverse.source[e];
+                if (r.inSubtree[y] || d[y] == UNREACHABLE) continue;
+                int alt = d[y] + reverse.cost[e];
+                if (alt < d[x]) {
+                    d[x] = alt;
+                    p[x] = y;
+                    hop[x] = y == src ? x : hop[y];
+                }
+            }
+            if (d[x] != UNREACHABLE) r.heap.emplace_back(d[x], x);
+        }
+        make_heap(r.heap.begin(), r.heap.end(), greater<pair<int, int>>());
+        settle(src, r);
+        return true;
+    }
 
-        
-        printLSRTable(src, dist, prev); // Print LSR table for the source node
+    // setLink changed the link u->v from oldCost to newCost (UNREACHABLE: no link): repair
+    // every tree that it affects
+    void linkChanged(int u, int v, int oldCost, int newCost, bool rebuilt) {
+        updateReverse(graph, reverse, u, v, rebuilt);
+        if (oldCost == newCost) return;
+        parallelFor(graph.n, 64, [&](int begin, int end, int worker) {
+            RepairScratch& r = scratch[worker];
+            for (int src = begin; src < end; ++src) {
+                if (repair(src, u, v, oldCost, newCost, r)) repairedTree[src] = 1;
+            }
+        });
+        for (RepairScratch& r : scratch) {
+            settled += r.settled;
+            r.settled = 0;
+        }
+    }
+
+    // Start counting the work of a new event
+    void resetCounters() {
+        settled = 0;
+        repairedTree.assign(graph.n, 0);
+    }
+};
+
+// Time both simulations, without printing the tables, on 1 to maxThreads threads
+void scalingReport(const Graph& graph, int maxThreads) {
+    cout << "Threads\tDVR (s)\tSpeedup\tLSR (s)\tSpeedup\tTables\n";
+    double dvrBase = 0, lsrBase = 0;
+    uint64_t dvrExpected = 0, lsrExpected = 0;
+    for (numThreads = 1; numThreads <= maxThreads; ++numThreads) {
+        auto start = chrono::steady_clock::now();
+        uint64_t dvr = simulateDVR(graph, false);
+        auto middle = chrono::steady_clock::now();
+        uint64_t lsr = simulateLSR(graph, false);
+        auto end = chrono::steady_clock::now();
+        double dvrTime = chrono::duration<double>(middle - start).count();
+        double lsrTime = chrono::duration<double>(end - middle).count();
+        if (numThreads == 1) {
+            dvrBase = dvrTime;
+            lsrBase = lsrTime;
+            dvrExpected = dvr;
+            lsrExpected = lsr;
+        }
+        cout << numThreads << fixed << setprecision(3) << "\t" << dvrTime << "\t" << setprecision(2) << dvrBase / dvrTime
+             << "\t" << setprecision(3) << lsrTime << "\t" << setprecision(2) << lsrBase / lsrTime << "\t"
+             << (dvr == dvrExpected && lsr == lsrExpected ? "identical" : "DIFFERENT") << endl;
     }
 }
 
-// Read graph from input file
-vector<vector<int>> readGraphFromFile(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
+// Cursor over the memory-mapped input file
+struct Reader {
+    const char* p;
+    const char* end;
+
+    void skipSpace() {
+        while (p < end && isspace((unsigned char)*p)) ++p;
+    }
+
+    void skipLine() {
+        const char* eol = (const char*)memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+
+    bool readInt(int& value) {
+        skipSpace();
+        from_chars_result result = from_chars(p, end, value);
+        if (result.ec != errc()) return false;
+        p = result.ptr;
+        return true;
+    }
+};
+
+// Largest link cost the simulations accept: a route has at most n links, so no distance
+// they add up can overflow an int or reach UNREACHABLE
+int maxLinkCost(int n) {
+    return numeric_limits<int>::max() / max(n, 1);
+}
+
+// Build the CSR arrays from links given in any order (counting sort by source)
+void buildGraph(Graph& graph, const vector<int>& from, const vector<int>& to, const vector<int>& cost) {
+    graph.offset.assign(graph.n + 1, 0);
+    for (int u : from) graph.offset[u + 1]++;
+    for (int u = 0; u < graph.n; ++u) graph.offset[u + 1] += graph.offset[u];
+    graph.target.resize(from.size());
+    graph.cost.resize(from.size());
+    vector<int> next(graph.offset.begin(), graph.offset.end() - 1);
+    for (size_t i = 0; i < from.size(); ++i) {
+        int slot = next[from[i]]++;
+        graph.target[slot] = to[i];
+        graph.cost[slot] = cost[i];
+    }
+}
+
+// Adjacency matrix: n, then n rows of n costs (INF for no link). Rows are turned into CSR as
+// they are read, so the matrix itself is never stored.
+void readMatrix(Reader& in, Graph& graph, const string& filename) {
+    if (!in.readInt(graph.n) || graph.n < 0) {
+        cerr << "Error: Bad node count in " << filename << endl;
+        exit(1);
+    }
+    graph.offset.assign(1, 0);
+    for (int i = 0; i < graph.n; ++i) {
+        for (int j = 0; j < graph.n; ++j) {
+            int cost;
+            if (!in.readInt(cost)) {
+                cerr << "Error: Expected " << graph.n << "x" << graph.n << " matrix in " << filename << endl;
+                exit(1);
+            }
+            if (cost != INF && i != j) {
+                if (cost > maxLinkCost(graph.n)) {
+                    cerr << "Error: Link cost " << cost << " above " << maxLinkCost(graph.n) << " in " << filename << endl;
+                    exit(1);
+                }
+                graph.target.push_back(j);
+                graph.cost.push_back(cost);
+            }
+        }
+        graph.offset.push_back(graph.target.size());
+    }
+}
+
+// Edge list in the DIMACS shortest-path format: "c" comment lines, one "p sp <nodes> <links>"
+// line, then one "a <from> <to> <cost>" line per directed link, with nodes numbered from 1.
+void readEdgeList(Reader& in, Graph& graph, const string& filename) {
+    vector<int> from, to, cost;
+    bool header = false;
+    auto malformed = [&]() {
+        cerr << "Error: Malformed edge list " << filename << endl;
+        exit(1);
+    };
+    while (true) {
+        in.skipSpace();
+        if (in.p == in.end) break;
+        char kind = *in.p++;
+        if (kind == 'c') {
+            in.skipLine();
+        } else if (kind == 'p' && !header) {
+            in.skipSpace();
+            if (in.end - in.p < 2 || in.p[0] != 's' || in.p[1] != 'p') malformed();
+            in.p += 2;
+            int links;
+            if (!in.readInt(graph.n) || !in.readInt(links) || graph.n < 0 || links < 0) malformed();
+            from.reserve(links);
+            to.reserve(links);
+            cost.reserve(links);
+            header = true;
+        } else if (kind == 'a' && header) {
+            int u, v, c;
+            if (!in.readInt(u) || !in.readInt(v) || !in.readInt(c)) malformed(); // Also a truncated last link
+            if (u < 1 || u > graph.n || v < 1 || v > graph.n || c < 0 || c > maxLinkCost(graph.n)) {
+                cerr << "Error: Bad link " << u << " " << v << " " << c << " in " << filename << endl;
+                exit(1);
+            }
+            if (u == v) continue; // Self-loops never shorten a path
+            from.push_back(u - 1);
+            to.push_back(v - 1);
+            cost.push_back(c);
+        } else {
+            malformed();
+        }
+    }
+    if (!header) malformed();
+    buildGraph(graph, from, to, cost);
+}
+
+// Read graph from input file: an adjacency matrix, or an edge list if the file starts with
+// a "c" or "p" line. The file is memory-mapped and parsed in place with from_chars.
+Graph readGraphFromFile(const string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0) {
         cerr << "Error: Could not open file " << filename << endl;
         exit(1);
     }
-    
-    int n;
-    file >> n;  // Number of nodes
-    vector<vector<int>> graph(n, vector<int>(n));
+    Graph graph;
+    const char* data = "";
+    if (info.st_size > 0) {
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            cerr << "Error: Could not map file " << filename << endl;
+            exit(1);
+        }
+        madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+        data = (const char*)mapped;
+    }
+    close(fd);
 
-    // Read adjacency matrix
-    for (int i = 0; i < n; ++i)
-        for (int j = 0; j < n; ++j)
-            file >> graph[i][j];
+    Reader in{data, data + info.st_size};
+    in.skipSpace();
+    if (in.p < in.end && (*in.p == 'c' || *in.p == 'p')) {
+        readEdgeList(in, graph, filename);
+    } else {
+        readMatrix(in, graph, filename);
+    }
 
-    file.close();
+    if (info.st_size > 0) munmap((void*)data, info.st_size);
     return graph;
 }
 
+// One line of a change script
+struct LinkEvent {
+    int time;
+    int u, v;
+    int cost;    // UNREACHABLE for a failure
+    string text; // The change as written back in the report
+};
+
+// Change script: one event per line, "t=<time> link <u>-<v> cost <c>" to set a link's cost
+// (bringing it up if it was down) or "t=<time> fail <u>-<v>" to take it down. Nodes are
+// numbered as in the tables and both directions of the link change. Blank lines and lines
+// starting with "#" are skipped. Events are returned in time order.
+vector<LinkEvent> readChanges(const string& filename, int n) {
+    ifstream file(filename);
+    if (!file) {
+        cerr << "Error: Could not open file " << filename << endl;
+        exit(1);
+    }
+    vector<LinkEvent> events;
+    string line;
+    for (int number = 1; getline(file, line); ++number) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') continue;
+        LinkEvent event;
+        int used = -1;
+        if (sscanf(line.c_str(), " t=%d link %d-%d cost %d %n", &event.time, &event.u, &event.v, &event.cost, &used) == 4 &&
+            used == (int)line.size() && event.cost >= 0 && event.cost <= maxLinkCost(n)) {
+            event.text = "link " + to_string(event.u) + "-" + to_string(event.v) + " cost " + to_string(event.cost);
+        } else if (used = -1, sscanf(line.c_str(), " t=%d fail %d-%d %n", &event.time, &event.u, &event.v, &used) == 3 &&
+                   used == (int)line.size()) {
+            event.cost = UNREACHABLE;
+            event.text = "fail " + to_string(event.u) + "-" + to_string(event.v);
+        } else {
+            cerr << "Error: Bad change on line " << number << " of " << filename << endl;
+            exit(1);
+        }
+        if (event.u < 0 || event.u >= n || event.v < 0 || event.v >= n || event.u == event.v) {
+            cerr << "Error: Bad link " << event.u << "-" << event.v << " on line " << number << " of " << filename << endl;
+            exit(1);
+        }
+        events.push_back(event);
+    }
+    stable_sort(events.begin(), events.end(), [](const LinkEvent& a, const LinkEvent& b) { return a.time < b.time; });
+    return events;
+}
+
+// Set the cost of the link u->v (UNREACHABLE takes it down) and return its old cost.
+// Parallel links u->v are merged into one. A new cost is written in place; a link that comes
+// up or goes down, or parallel links being merged, rebuilds the CSR arrays and sets rebuilt.
+int setLink(Graph& graph, int u, int v, int cost, bool& rebuilt) {
+    rebuilt = false;
+    int oldCost = UNREACHABLE, links = 0, slot = -1;
+    for (int e = graph.offset[u]; e < graph.offset[u + 1]; ++e) {
+        if (graph.target[e] != v) continue;
+        oldCost = min(oldCost, graph.cost[e]);
+        links++;
+        slot = e;
+    }
+    if (links == 1 && cost != UNREACHABLE) {
+        graph.cost[slot] = cost;
+    } else if (links > 0 || cost != UNREACHABLE) {
+        vector<int> from, to, costs;
+        for (int x = 0; x < graph.n; ++x) {
+            for (int e = graph.offset[x]; e < graph.offset[x + 1]; ++e) {
+                if (x == u && graph.target[e] == v) continue;
+                from.push_back(x);
+                to.push_back(graph.target[e]);
+                costs.push_back(graph.cost[e]);
+            }
+        }
+        if (cost != UNREACHABLE) {
+            from.push_back(u);
+            to.push_back(v);
+            costs.push_back(cost);
+        }
+        buildGraph(graph, from, to, costs);
+        rebuilt = true;
+    }
+    return oldCost;
+}
+
+// Run both simulations, then apply a change script. DVR propagates each event with the
+// event-driven engine and LSR repairs the affected trees. Every event reports the work both
+// took and prints the tables that changed.
+void simulateChanges(Graph& graph, const vector<LinkEvent>& events, bool poisonedReverse) {
+    cout << "\n--- Distance Vector Routing Simulation ---\n";
+    AsyncDVR dvr(graph, poisonedReverse);
+    simulateAsyncDVR(dvr);
+
+    cout << "\n--- Link State Routing Simulation ---\n";
+    DynamicLSR lsr(graph);
+    for (int i = 0; i < graph.n; ++i) printLSRTable(i, lsr.dist[i], lsr.firstHop[i]);
+
+    for (const LinkEvent& event : events) {
+        cout << "\n--- Event t=" << event.time << ": " << event.text << " ---\n";
+        dvr.resetCounters();
+        lsr.resetCounters();
+        double dvrTime = 0, lsrTime = 0;
+        for (int direction = 0; direction < 2; ++direction) {
+            int u = direction ? event.v : event.u, v = direction ? event.u : event.v;
+            bool rebuilt;
+            int oldCost = setLink(graph, u, v, event.cost, rebuilt);
+            auto start = chrono::steady_clock::now();
+            dvr.linkChanged(u, v, oldCost, event.cost, rebuilt);
+            auto middle = chrono::steady_clock::now();
+            lsr.linkChanged(u, v, oldCost, event.cost, rebuilt);
+            auto end = chrono::steady_clock::now();
+            dvrTime += chrono::duration<double, milli>(middle - start).count();
+            lsrTime += chrono::duration<double, milli>(end - middle).count();
+        }
+        auto start = chrono::steady_clock::now();
+        dvr.run();
+        dvrTime += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        int repaired = count(lsr.repairedTree.begin(), lsr.repairedTree.end(), 1);
+        cout << "DVR: " << dvr.activations << " node updates, " << dvr.messages << " messages, " << dvr.entries
+             << " entries, converged after " << dvr.lastChange << " message delays; " << dvr.countedToInfinity
+             << " routes counted to infinity (" << fixed << setprecision(3) << dvrTime << " ms)\n";
+        cout << "LSR: " << repaired << " of " << graph.n << " trees repaired, " << lsr.settled << " nodes settled ("
+             << lsrTime << " ms)\n";
+        cout << "--- DVR Tables that changed ---\n";
+        for (int i = 0; i < graph.n; ++i) {
+            if (dvr.touched[i]) printDVRTable(i, dvr.dist, dvr.nextHop);
+        }
+        cout << "--- LSR Tables that changed ---\n";
+        for (int i = 0; i < graph.n; ++i) {
+            if (lsr.repairedTree[i]) printLSRTable(i, lsr.dist[i], lsr.firstHop[i]);
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
-    // Check command-line argument for input file
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <input_file>\n";
+    // Check command-line arguments: options, then the input file
+    int scalingThreads = 0;
+    bool asyncDVR = false, poisonedReverse = true;
+    string changesFile;
+    int i = 1;
+    for (; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        if (option == "--threads") {
+            numThreads = atoi(argv[i + 1]);
+            if (numThreads <= 0) numThreads = max(1u, thread::hardware_concurrency());
+        } else if (option == "--dvr" && (string(argv[i + 1]) == "sync" || string(argv[i + 1]) == "async")) {
+            asyncDVR = string(argv[i + 1]) == "async";
+        } else if (option == "--changes") {
+            changesFile = argv[i + 1];
+        } else if (option == "--poisoned-reverse" && (string(argv[i + 1]) == "on" || string(argv[i + 1]) == "off")) {
+            poisonedReverse = string(argv[i + 1]) == "on";
+        } else if (option == "--scaling") {
+            scalingThreads = atoi(argv[i + 1]);
+            if (scalingThreads <= 0) scalingThreads = max(1u, thread::hardware_concurrency());
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1) {
+        cerr << "Usage: " << argv[0] << " [--threads N] [--dvr sync|async] [--scaling MAX_THREADS]\n"
+             << "       [--changes FILE] [--poisoned-reverse on|off] <input_file>\n";
         return 1;
     }
 
-    string filename = argv[1];
-    vector<vector<int>> graph = readGraphFromFile(filename); // Load graph
+    string filename = argv[i];
+    Graph graph = readGraphFromFile(filename); // Load graph
+
+    if (scalingThreads > 0) {
+        scalingReport(graph, scalingThreads);
+        return 0;
+    }
+
+    if (!changesFile.empty()) {
+        simulateChanges(graph, readChanges(changesFile, graph.n), poisonedReverse); // Always event-driven DVR
+        return 0;
+    }
 
     cout << "\n--- Distance Vector Routing Simulation ---\n";
-    simulateDVR(graph); // Run DVR simulation
+    if (asyncDVR) {
+        AsyncDVR dvr(graph, poisonedReverse);
+        simulateAsyncDVR(dvr); // Run event-driven DVR simulation
+    } else {
+        simulateDVR(graph); // Run DVR simulation
+    }
 
     cout << "\n--- Link State Routing Simulation ---\n";
     simulateLSR(graph); // Run LSR simulation
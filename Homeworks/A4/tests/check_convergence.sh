@@ -0,0 +1,19 @@
+#!/bin/sh
+# Convergence check for link failures: when the only link to node 9 of tests/ring.txt fails,
+# every node must find node 9 unreachable, and DVR must settle within the hop limit of
+# n - 1 = 9 message delays, with and without poisoned reverse. Run from Homeworks/A4.
+status=0
+for poison in on off; do
+    output=$(./routing_sim --poisoned-reverse $poison --changes tests/ring_changes.txt tests/ring.txt) || exit 1
+    event=$(printf '%s\n' "$output" | sed -n '/^--- Event t=1:/,/^--- Event t=2:/p')
+    delays=$(printf '%s\n' "$event" | sed -n 's/^DVR: .* converged after \([0-9]*\) message delays.*/\1/p')
+    dvr=$(printf '%s\n' "$event" | sed -n '/^--- DVR Tables/,/^--- LSR Tables/p' | grep -c "^9	9999	-$")
+    lsr=$(printf '%s\n' "$event" | sed -n '/^--- LSR Tables/,$p' | grep -c "^9	9999	-1$")
+    if [ -z "$delays" ] || [ "$delays" -gt 9 ] || [ "$dvr" -ne 9 ] || [ "$lsr" -ne 9 ]; then
+        echo "FAIL (poisoned reverse $poison): ${delays:-no} message delays, node 9 unreachable in $dvr DVR and $lsr LSR tables"
+        status=1
+    else
+        echo "ok (poisoned reverse $poison): converged after $delays message delays"
+    fi
+done
+exit $status